@@ -0,0 +1,22 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace AreaTools
+ */
+// ======================================================================
+
+#ifndef AREATOOLS_H
+#define AREATOOLS_H
+
+#include <newbase/NFmiArea.h>
+#include <string>
+
+namespace AreaTools
+{
+std::string fingerprint(const NFmiArea &theArea);
+
+}  // namespace AreaTools
+
+#endif  // AREATOOLS_H
+
+// ======================================================================
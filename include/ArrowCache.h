@@ -9,6 +9,7 @@
 #define ARROWCACHE_H
 
 #include <map>
+#include <mutex>
 #include <string>
 
 class ArrowCache
@@ -21,6 +22,7 @@ class ArrowCache
  private:
   typedef std::map<std::string, std::string> cache_type;
   cache_type itsCache;
+  std::mutex itsMutex;  // images may be rendered in parallel
 
 };  // class ArrowCache
 
@@ -0,0 +1,57 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class ColorPalette
+ */
+// ======================================================================
+/*!
+ * \class ColorPalette
+ * \brief A palette of colors known to be used in the images
+ *
+ * Most of the colors in the rendered images are known in advance:
+ * the contour colors, label colors and the colors of the background
+ * and other static images. Reducing the colors of an image to such a
+ * palette is much faster than generic color quantization, and keeps
+ * the palette identical in all frames of an animation.
+ *
+ * Colors not in the palette, for example those resulting from
+ * blending, are mapped to the nearest color in the palette. The
+ * palette is unusable if it has more colors than a palette image
+ * may have.
+ */
+// ======================================================================
+
+#ifndef COLORPALETTE_H
+#define COLORPALETTE_H
+
+#include <imagine/NFmiColorTools.h>
+#include <imagine/NFmiImage.h>
+
+#include <cstddef>
+#include <set>
+
+class ColorPalette
+{
+ public:
+  ColorPalette();
+
+  void add(Imagine::NFmiColorTools::Color theColor);
+  void add(const Imagine::NFmiColorTools::Color *theColors, std::size_t theCount);
+
+  std::size_t size() const;
+  bool usable() const;
+
+  void reduce(Imagine::NFmiImage &theImage) const;
+
+  static const std::size_t MaxColors = 256;
+
+ private:
+  Imagine::NFmiColorTools::Color nearest(Imagine::NFmiColorTools::Color theColor) const;
+
+  std::set<Imagine::NFmiColorTools::Color> itsColors;
+
+};  // class ColorPalette
+
+#endif  // COLORPALETTE_H
+
+// ======================================================================
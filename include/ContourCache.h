@@ -21,18 +21,28 @@
  * A good principle is to change nothing but the projection, the
  * background and foreground images and the savepath.
  *
+ * The parameters are packed into a compact Key, which is cheap
+ * to hash and compare. find() returns a pointer to the cached
+ * path or nullptr, so that a single lookup suffices to decide
+ * whether the contour must be calculated.
+ *
+ * The cache may also hold paths already projected onto a specific
+ * area, in which case the key holds the fingerprint of the area.
+ *
+ * The cache may be given a memory budget, in which case the least
+ * recently used contours are evicted whenever the approximate size
+ * of the stored paths exceeds the budget. The returned references
+ * hence remain valid only until the next insert.
+ *
  * Typical use is shown below.
  * \code
  * ContourCache cache;
  *
- * NFmiPath path;
- * if(cache.contains(lolimit, hilimit, querydata, time))
- *    path = cache.find(lolimit, hilimit, querydata, time);
- * else
- * {
- *    path = ... some means of calculating it;
- *    cache.insert(path, lolimit, hilimit, querydata, time);
- * }
+ * ContourCache::Key key = ContourCache::key(lolimit, hilimit, time, querydata);
+ * const NFmiPath *cached = cache.find(key);
+ * if (cached == nullptr)
+ *    cached = &cache.insert(key, ... some means of calculating it);
+ * NFmiPath path = *cached;
  * path.Project(area);
  * path.Fill(image, color, rule);
  * \endcode
@@ -44,47 +54,86 @@
 
 #include <imagine/NFmiPath.h>
 
-#include <map>
+#include <cstddef>
+#include <list>
 #include <string>
+#include <unordered_map>
 
 class LazyQueryData;
 class NFmiTime;
 
 class ContourCache
 {
+ public:
+  struct Key
+  {
+    float lolimit;
+    float hilimit;
+    bool isoline;  // contour line instead of a fill
+    unsigned long param;
+    float level;
+    long long time;        // YYYYMMDDHHMM
+    long long origintime;  // YYYYMMDDHHMM
+    std::string file;      // the querydata filename
+    std::string window;    // empty for the full grid
+    std::string area;      // projection fingerprint, empty if not projected
+    float simplify;        // SimplifyLines tolerance of a projected path, 0 for none
+
+    bool operator==(const Key &theOther) const;
+  };
+
+  struct KeyHash
+  {
+    std::size_t operator()(const Key &theKey) const;
+  };
+
  private:
-  typedef std::map<std::string, Imagine::NFmiPath> storage_type;
+  typedef std::list<const Key *> order_type;
+
+  struct Entry
+  {
+    Imagine::NFmiPath path;
+    std::size_t bytes;
+    order_type::iterator position;
+  };
+
+  typedef std::unordered_map<Key, Entry, KeyHash> storage_type;
   storage_type itsData;
+  order_type itsOrder;  // most recently used first
+  std::size_t itsBytes;
+  std::size_t itsMaxBytes;
+  std::size_t itsEvictions;
+
+  void evict();
 
  public:
   typedef storage_type::size_type size_type;
 
+  ContourCache();
+
 #ifdef NO_COMPILER_GENERATED
   ~ContourCache();
-  ContourCache();
   ContourCache(const ContourCache &theCache);
   ContourCache &operator=(const ContourCache &theCache);
 #endif
 
+  static Key key(float theLoLimit,
+                 float theHiLimit,
+                 const NFmiTime &theTime,
+                 const LazyQueryData &theData,
+                 const std::string &theWindow = "");
+
   bool empty() const;
   void clear();
   size_type size() const;
 
-  bool contains(float theLoLimit,
-                float theHiLimit,
-                const NFmiTime &theTime,
-                const LazyQueryData &theData) const;
-
-  const Imagine::NFmiPath &find(float theLoLimit,
-                                float theHiLimit,
-                                const NFmiTime &theTime,
-                                const LazyQueryData &theData) const;
-
-  void insert(const Imagine::NFmiPath &thePath,
-              float theLoLimit,
-              float theHiLimit,
-              const NFmiTime &theTime,
-              const LazyQueryData &theData);
+  void maxBytes(std::size_t theBytes);
+  std::size_t maxBytes() const { return itsMaxBytes; }
+  std::size_t bytes() const { return itsBytes; }
+  std::size_t evictions() const { return itsEvictions; }
+
+  const Imagine::NFmiPath *find(const Key &theKey);
+  const Imagine::NFmiPath &insert(const Key &theKey, const Imagine::NFmiPath &thePath);
 
 };  // class ContourCache
 
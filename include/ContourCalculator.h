@@ -18,14 +18,20 @@
 #pragma once
 
 #include "ContourInterpolation.h"
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 template <typename T>
 class NFmiDataMatrix;
 
 class ContourCalculatorPimple;
 class LazyQueryData;
+class NFmiArea;
 class NFmiTime;
 
 namespace Imagine
@@ -39,21 +45,67 @@ class ContourCalculator
   ~ContourCalculator();
   ContourCalculator();
 
-  Imagine::NFmiPath contour(const LazyQueryData &theData,
-                            float theLoLimit,
-                            float theHiLimit,
-                            const NFmiTime &theTime,
-                            ContourInterpolation theInterpolation);
+  typedef std::vector<std::pair<float, float> > Limits;
+  typedef std::vector<float> Values;
 
-  Imagine::NFmiPath contour(const LazyQueryData &theData,
-                            float theValue,
-                            const NFmiTime &theTime,
-                            ContourInterpolation theInterpolation);
+  // Where each contour of the latest batch was found from
+  enum CacheState
+  {
+    NotCached,
+    MemoryCached,
+    DiskCached
+  };
+  typedef std::vector<CacheState> CacheStates;
+
+  const Imagine::NFmiPath &contour(const LazyQueryData &theData,
+                                   float theLoLimit,
+                                   float theHiLimit,
+                                   const NFmiTime &theTime,
+                                   ContourInterpolation theInterpolation);
+
+  std::vector<Imagine::NFmiPath> contour(const LazyQueryData &theData,
+                                         const Limits &theLimits,
+                                         const NFmiTime &theTime,
+                                         ContourInterpolation theInterpolation);
+
+  const Imagine::NFmiPath &contour(const LazyQueryData &theData,
+                                   float theValue,
+                                   const NFmiTime &theTime,
+                                   ContourInterpolation theInterpolation);
+
+  std::vector<Imagine::NFmiPath> contour(const LazyQueryData &theData,
+                                         const Values &theValues,
+                                         const NFmiTime &theTime,
+                                         ContourInterpolation theInterpolation);
+
+  std::vector<Imagine::NFmiPath> contour(const LazyQueryData &theData,
+                                         const Limits &theLimits,
+                                         const NFmiTime &theTime,
+                                         ContourInterpolation theInterpolation,
+                                         const NFmiArea &theArea);
+
+  std::vector<Imagine::NFmiPath> contour(const LazyQueryData &theData,
+                                         const Values &theValues,
+                                         const NFmiTime &theTime,
+                                         ContourInterpolation theInterpolation,
+                                         const NFmiArea &theArea,
+                                         float theSimplify = 0);
 
   void data(const NFmiDataMatrix<float> &theData);
+  void window(std::size_t theI1, std::size_t theJ1, std::size_t theI2, std::size_t theJ2);
   void clearCache();
   void cache(bool);
+  void cacheMaxBytes(std::size_t theBytes);
+  void cacheDirectory(const std::string &theDirectory);
+  void cacheMaxDiskBytes(std::uint64_t theBytes);
+  std::size_t cacheEvictions() const;
+  std::size_t cacheWriteErrors() const;
+  std::size_t cacheBytes() const;
+  void threads(unsigned int theCount);
+  void tileSize(std::size_t theSize);
+  void settings(const ContourCalculator &theOther);
   bool wasCached(void) const;
+  const CacheStates &cacheStates() const;
 
  private:
   ContourCalculator(const ContourCalculator &theCalc);
@@ -0,0 +1,87 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class ContourDiskCache
+ */
+// ======================================================================
+/*!
+ * \class ContourDiskCache
+ * \brief Persistent storage for calculated contours
+ *
+ * The disk cache lets separate qdcontour processes share contours
+ * calculated from the same data. Each contour is stored into its own
+ * file in the cache directory, named after a hash of the key. The key
+ * identifies the querydata by its size and modification time, and
+ * the contoured values by a hash of the grid, so that any change in
+ * the value pipeline (smoothing, filtering, unit conversions etc)
+ * produces a new key.
+ *
+ * The file format is
+ * \code
+ * char[8]   magic "QDCCACHE"
+ * uint32    version
+ * uint32    key size
+ * char[]    key, padded to 8 bytes
+ * uint64    number of path elements
+ * uint8[]   path operations, padded to 8 bytes
+ * double[]  x and y coordinates of the path elements
+ * \endcode
+ * in native byte order. The files are memory mapped for reading, and
+ * are written into temporary files which are then renamed so that
+ * concurrent processes never see partial files.
+ *
+ * Files are never modified once written. If a size limit is set,
+ * the oldest files are removed whenever the limit is exceeded,
+ * otherwise the directory must be cleaned up externally.
+ */
+// ======================================================================
+
+#ifndef CONTOURDISKCACHE_H
+#define CONTOURDISKCACHE_H
+
+#include "ContourCache.h"
+#include "ContourInterpolation.h"
+
+#include <imagine/NFmiPath.h>
+
+#include <cstdint>
+#include <string>
+
+class LazyQueryData;
+
+class ContourDiskCache
+{
+ public:
+  ContourDiskCache();
+
+  void directory(const std::string &theDirectory);
+  const std::string &directory() const { return itsDirectory; }
+  bool enabled() const { return !itsDirectory.empty(); }
+
+  void maxBytes(std::uint64_t theBytes);
+  std::uint64_t maxBytes() const { return itsMaxBytes; }
+
+  static std::string key(const ContourCache::Key &theKey,
+                         ContourInterpolation theInterpolation,
+                         const LazyQueryData &theData,
+                         std::uint64_t theValueHash,
+                         std::uint64_t theTileSize);
+
+  static std::uint64_t hash(const float *theValues, std::size_t theCount, std::uint64_t theSeed);
+
+  bool find(const std::string &theKey, Imagine::NFmiPath &thePath) const;
+  bool insert(const std::string &theKey, const Imagine::NFmiPath &thePath);
+
+ private:
+  std::string filename(const std::string &theKey) const;
+  void cleanup() const;
+
+  std::string itsDirectory;
+  std::uint64_t itsMaxBytes;      // 0 for no limit
+  std::uint64_t itsWrittenBytes;  // bytes written since the size was last checked
+
+};  // class ContourDiskCache
+
+#endif  // CONTOURDISKCACHE_H
+
+// ======================================================================
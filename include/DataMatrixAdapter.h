@@ -1,6 +1,13 @@
 #pragma once
 
 #include <newbase/NFmiDataMatrix.h>
+#include <memory>
+#include <vector>
+
+// Tron grid adapter for data values stored contiguously in row-major
+// order. The values are copied once from the NFmiDataMatrix, which is
+// a vector of columns, so that the contourer and the tiles, windows
+// and extrema calculations all scan memory sequentially along rows.
 
 class DataMatrixAdapter
 {
@@ -9,30 +16,66 @@ class DataMatrixAdapter
   using coord_type = float;
 
   using size_type = NFmiDataMatrix<float>::size_type;
+  using storage_type = std::vector<value_type>;
 
-  DataMatrixAdapter(const NFmiDataMatrix<float> &theMatrix)
-      : itsMatrix(theMatrix), itsWidth(theMatrix.NX()), itsHeight(theMatrix.NY())
+  explicit DataMatrixAdapter(const NFmiDataMatrix<float> &theMatrix)
+      : itsValues(std::make_shared<storage_type>(theMatrix.NX() * theMatrix.NY())),
+        itsStride(theMatrix.NX()),
+        itsI0(0),
+        itsJ0(0),
+        itsWidth(theMatrix.NX()),
+        itsHeight(theMatrix.NY()),
+        itsOrigin(itsValues->data())
+  {
+    storage_type &values = *itsValues;
+    for (size_type i = 0; i < itsWidth; i++)
+    {
+      const auto &column = theMatrix[i];
+      for (size_type j = 0; j < itsHeight; j++)
+        values[j * itsStride + i] = column[j];
+    }
+  }
+
+  // Adapter for a rectangular window of another adapter sharing the
+  // same values. Coordinates are still expressed in the grid
+  // coordinates of the full matrix.
+  DataMatrixAdapter(const DataMatrixAdapter &theAdapter,
+                    size_type theI0,
+                    size_type theJ0,
+                    size_type theWidth,
+                    size_type theHeight)
+      : itsValues(theAdapter.itsValues),
+        itsStride(theAdapter.itsStride),
+        itsI0(theAdapter.itsI0 + theI0),
+        itsJ0(theAdapter.itsJ0 + theJ0),
+        itsWidth(theWidth),
+        itsHeight(theHeight),
+        itsOrigin(theAdapter.itsOrigin + theJ0 * theAdapter.itsStride + theI0)
   {
   }
 
-  // Provide wrap-around capability for world data
   const value_type &operator()(size_type i, size_type j) const
   {
-    return itsMatrix[i % itsWidth][j];
+    return itsOrigin[j * itsStride + i];
   }
 
-  // Now wrap-around for coordinates, we need both left and right
-  // edge coordinates for world data
-  coord_type x(size_type i, size_type j) const { return static_cast<float>(i); }
-  coord_type y(size_type i, size_type j) const { return static_cast<float>(j); }
+  coord_type x(size_type i, size_type j) const { return static_cast<float>(itsI0 + i); }
+  coord_type y(size_type i, size_type j) const { return static_cast<float>(itsJ0 + j); }
   bool valid(size_type i, size_type j) const { return true; }
   size_type width() const { return itsWidth; }
   size_type height() const { return itsHeight; }
 
+  // Start of the row j of the window, the row has width() values
+  const value_type *row(size_type j) const { return itsOrigin + j * itsStride; }
+
  private:
   DataMatrixAdapter();
-  const NFmiDataMatrix<float> &itsMatrix;
+  std::shared_ptr<storage_type> itsValues;
+  const size_type itsStride;
+  const size_type itsI0;
+  const size_type itsJ0;
   const size_type itsWidth;
   const size_type itsHeight;
+  const value_type *itsOrigin;
 
 };  // class DataMatrixAdapter
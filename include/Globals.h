@@ -9,13 +9,17 @@
 #define GLOBALS_H
 
 #include "ArrowCache.h"
+#include "ColorPalette.h"
 #include "ContourCalculator.h"
 #include "ContourSpec.h"
 #include "ExtremaLocator.h"
 
 #include "ImageCache.h"
+#include "ImagePool.h"
+#include "ImageWriter.h"
 
 #include "LabelLocator.h"
+#include "QueryDataPool.h"
 #include "ShapeSpec.h"
 #include "UnitsConverter.h"
 
@@ -33,6 +37,7 @@
 #include <memory>
 
 #include <list>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -114,6 +119,7 @@ struct Globals
 
   bool verbose;                          // -v option
   bool force;                            // -f option
+  unsigned int threads;                  // -j option
   std::string cmdline_querydata;         // -q option
   std::string cmdline_conf;              // -c option
   std::list<std::string> cmdline_files;  // command line parameters
@@ -140,12 +146,17 @@ struct Globals
   bool savealpha;      // save alpha channel?
 
   bool reducecolors;  // reduce colors before saving?
+  bool knownpalette;  // reduce colors to the known contour colors?
+
+  std::shared_ptr<ColorPalette> palette;  // known colors of the current images
 
   bool wantpalette;   // attempt to save as palette image?
   bool forcepalette;  // force palette image?
 
-  std::string contourinterpolation;  // contouring interpolation method
-  int contourtriangles;              // keep triangles in result or simplify?
+  std::string contourinterpolation;    // contouring interpolation method
+  int contourtriangles;                // keep triangles in result or simplify?
+  bool contourviewport;                // contour only the visible part of the grid?
+  unsigned int contourviewportmargin;  // extra grid cells around the visible part
 
   std::string smoother;  // smoothing method
   float smootherradius;  // smoothing radius
@@ -204,6 +215,9 @@ struct Globals
 
   std::string queryfilelist;                // querydata files in use
   std::vector<std::string> queryfilenames;  // querydata files in use
+  unsigned int slicecache;                  // number of cached grids per querydata
+  bool prefetch;                            // extract next image values in advance?
+  unsigned int imagethreads;                // number of images rendered in parallel
 
   std::shared_ptr<LazyQueryData> queryinfo;  // active data, does not own pointer
   int querydatalevel;                        // level value (-1 for first)
@@ -246,8 +260,14 @@ struct Globals
 
   ContourCalculator calculator;                  // data contourer
   ContourCalculator maskcalculator;              // mask contourer
+  std::vector<std::shared_ptr<ContourCalculator>> imagecalculators;  // parallel image contourers
   std::shared_ptr<LazyQueryData> maskqueryinfo;  // active mask data, does not own pointer
   std::vector<std::shared_ptr<LazyQueryData>> querystreams;
+  QueryDataPool querypool;  // all querydata read so far
+
+  // (parameter, level) to (querystream, level index), -1 is the first level
+  typedef std::map<std::pair<int, int>, std::pair<unsigned int, unsigned long> > StreamIndex;
+  StreamIndex querystreamindex;
 
   std::list<ShapeSpec> shapespecs;
   std::list<ContourSpec> specs;
@@ -275,6 +295,11 @@ struct Globals
   std::list<ArrowStyle> arrowstrokestyles;
 
   unsigned long timestampformat;
+
+  ImagePool imagepool;  // recycled images for rendering
+
+  // Last so that pending writes are stopped before anything else is destroyed
+  ImageWriter imagewriter;
 };
 
 // For global use
@@ -15,6 +15,7 @@
 #include <imagine/NFmiImage.h>
 
 #include <map>
+#include <mutex>
 #include <string>
 
 class ImageCache
@@ -26,6 +27,7 @@ class ImageCache
  private:
   typedef std::map<std::string, ImagineXr_or_NFmiImage> storage_type;
   mutable storage_type itsCache;
+  mutable std::mutex itsMutex;  // images may be rendered in parallel
 };
 
 #endif  // IMAGECACHE_H
@@ -0,0 +1,53 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class ImagePool
+ */
+// ======================================================================
+/*!
+ * \class ImagePool
+ * \brief Recycles images of the same size
+ *
+ * Allocating a new image for each rendered timestep is expensive for
+ * large images. The ImagePool hands out images which are returned to
+ * the pool once the last reference to them is released, for example
+ * once the image has been written. The contents of the returned
+ * images are undefined, the caller is expected to overwrite them.
+ *
+ * Only images of the most recently requested size are kept.
+ */
+// ======================================================================
+
+#ifndef IMAGEPOOL_H
+#define IMAGEPOOL_H
+
+#include <imagine/NFmiImage.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class ImagePool
+{
+ public:
+  ImagePool();
+
+  std::shared_ptr<Imagine::NFmiImage> get(int theWidth, int theHeight);
+  void clear();
+
+ private:
+  ImagePool(const ImagePool &theOther);
+  ImagePool &operator=(const ImagePool &theOther);
+
+  void release(Imagine::NFmiImage *theImage);
+
+  int itsWidth;
+  int itsHeight;
+  std::vector<std::unique_ptr<Imagine::NFmiImage> > itsImages;  // unused images
+  std::mutex itsMutex;
+
+};  // class ImagePool
+
+#endif  // IMAGEPOOL_H
+
+// ======================================================================
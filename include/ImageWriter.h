@@ -0,0 +1,80 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class ImageWriter
+ */
+// ======================================================================
+/*!
+ * \class ImageWriter
+ * \brief Writes finished images on a pool of background threads
+ *
+ * Encoding and compressing an image may take as long as rendering
+ * it. The ImageWriter lets the next image be rendered while the
+ * previous ones are being written. The number of queued images is
+ * limited, further writes block until there is room in the queue.
+ * This bounds the memory used by the images waiting to be written.
+ *
+ * Errors are collected and reported by wait(), which waits for
+ * all queued images to be written. Without any threads the images
+ * are written immediately, and errors are thrown immediately.
+ *
+ * The writing tasks must own the images they write, and must not
+ * depend on settings which may change before they are run.
+ */
+// ======================================================================
+
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ImageWriter
+{
+ public:
+  typedef std::function<void()> Task;
+
+  ImageWriter();
+  ~ImageWriter();
+
+  void threads(unsigned int theCount);
+  unsigned int threads() const;
+  void queueSize(std::size_t theSize);
+
+  void write(const std::string &theFile, const Task &theTask);
+  bool pending(const std::string &theFile) const;
+  void wait();
+
+ private:
+  ImageWriter(const ImageWriter &theOther);
+  ImageWriter &operator=(const ImageWriter &theOther);
+
+  void work();
+  void stop();
+
+  typedef std::pair<std::string, Task> Job;
+
+  std::vector<std::thread> itsThreads;
+  std::list<Job> itsQueue;
+  std::multiset<std::string> itsPending;  // queued or being written
+  std::size_t itsQueueSize;
+  std::size_t itsActive;
+  bool itIsStopping;
+  std::vector<std::string> itsErrors;
+
+  mutable std::mutex itsMutex;
+  std::condition_variable itsWorkAvailable;
+  std::condition_variable itsWorkDone;
+
+};  // class ImageWriter
+
+#endif  // IMAGEWRITER_H
+
+// ======================================================================
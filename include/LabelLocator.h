@@ -10,6 +10,7 @@
 
 #include <list>
 #include <map>
+#include <vector>
 
 class LabelLocator
 {
@@ -30,6 +31,9 @@ class LabelLocator
 
   void add(float theContour, int theX, int theY);
 
+  void record(bool theFlag);
+  void replay(const LabelLocator &theRecorder);
+
   typedef std::pair<int, int> XY;
   typedef std::multimap<float, XY> Coordinates;
   typedef std::map<float, Coordinates> ContourCoordinates;
@@ -57,6 +61,17 @@ class LabelLocator
   ParamCoordinates itsPreviousCoordinates;
   ParamCoordinates itsCurrentCoordinates;
 
+  struct Candidate
+  {
+    int param;
+    float contour;
+    int x;
+    int y;
+  };
+
+  bool itIsRecording;
+  std::vector<Candidate> itsRecording;  // candidates in the order added
+
   // Private methods:
 
   bool inside(int theX1, int theY1) const;
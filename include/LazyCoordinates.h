@@ -13,8 +13,8 @@
  *
  * To optimize the code we hence use a lazy matrix of coordinates,
  * which acts like a Fmi::CoordinateMatrix, except that
- * the coordinates are only fetched from the global querydata
- * holder if necessary.
+ * the coordinates are only fetched from the given querydata
+ * if necessary.
  *
  */
 // ======================================================================
@@ -22,7 +22,6 @@
 #ifndef LAZYCOORDINATES_H
 #define LAZYCOORDINATES_H
 
-#include "Globals.h"
 #include "LazyQueryData.h"
 #include <gis/CoordinateMatrix.h>
 #include <newbase/NFmiPoint.h>
@@ -34,7 +33,7 @@ class LazyCoordinates
   typedef NFmiPoint element_type;
   typedef std::size_t size_type;
 
-  LazyCoordinates(const NFmiArea &theArea);
+  LazyCoordinates(const NFmiArea &theArea, const LazyQueryData &theQueryData);
   NFmiPoint operator()(size_type i, size_type j) const;
   NFmiPoint operator()(int i, int j, const NFmiPoint &theDefault) const;
   const data_type &operator*() const;
@@ -45,6 +44,7 @@ class LazyCoordinates
 
  private:
   const NFmiArea &itsArea;
+  const LazyQueryData &itsQueryData;
   mutable bool itsInitialized;
   mutable data_type itsData;
 
@@ -142,7 +142,7 @@ inline void LazyCoordinates::init() const
   if (itsInitialized)
     return;
 
-  itsData = *globals.queryinfo->LocationsWorldXY(itsArea);
+  itsData = *itsQueryData.LocationsWorldXY(itsArea);
   itsInitialized = true;
 }
 
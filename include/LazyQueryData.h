@@ -13,7 +13,23 @@
  * necessary.
  *
  * The basic idea is to always read the header, but the data part
- * only when it is required.
+ * only when it is required. This is accomplished by memory mapping
+ * the data section of the file, so that only the pages containing
+ * the requested values are ever read from disk.
+ *
+ * Optionally the most recently extracted grids are kept in a small
+ * cache keyed by the parameter, level and time, so that time
+ * filtering and meta functions extracting the same grids repeatedly
+ * need to decode each grid only once.
+ *
+ * Grid coordinates projected onto an area are cached separately for
+ * world and image coordinates for a few of the most recently used
+ * areas, so that alternating between projections does not require
+ * transforming the grid again.
+ *
+ * The times and levels of the data are indexed when the data is
+ * read, so that a specific time or level can be selected with a
+ * binary search instead of iterating over all of them.
  *
  */
 // ======================================================================
@@ -25,8 +41,10 @@
 #include <newbase/NFmiDataMatrix.h>
 #include <newbase/NFmiMetTime.h>
 #include <newbase/NFmiParameterName.h>
+#include <list>
 #include <memory>
 #include <string>
+#include <vector>
 
 class NFmiArea;
 class NFmiFastQueryInfo;
@@ -55,6 +73,7 @@ class LazyQueryData
   // These do not require the data values
 
   void Read(const std::string &theDataFile);
+  std::shared_ptr<LazyQueryData> Clone() const;
 
   void ResetTime();
   void ResetLevel();
@@ -64,6 +83,11 @@ class LazyQueryData
   bool NextLevel();
   bool NextTime();
   bool PreviousTime();
+  bool SetTime(const NFmiTime &theTime);
+  bool SetTimeAtOrAfter(const NFmiTime &theTime);
+  bool SetLevel(float theLevel);
+  unsigned long LevelIndex() const;
+  bool LevelIndex(unsigned long theIndex);
   const NFmiLevel *Level() const;
 
   bool Param(FmiParameterName theParam);
@@ -101,6 +125,10 @@ class LazyQueryData
 
   NFmiDataMatrix<float> Values();
   NFmiDataMatrix<float> Values(const NFmiMetTime &theTime);
+  void Values(NFmiDataMatrix<float> &theValues);
+  void Values(NFmiDataMatrix<float> &theValues, const NFmiMetTime &theTime);
+
+  void SliceCacheSize(std::size_t theSize);
 
  private:
   LazyQueryData(const LazyQueryData &theQD);
@@ -111,10 +139,49 @@ class LazyQueryData
   std::shared_ptr<NFmiFastQueryInfo> itsInfo;
   std::shared_ptr<NFmiQueryData> itsData;
 
+  struct AreaLocations
+  {
+    std::size_t hash;         // hash of the fingerprint for fast comparisons
+    std::string fingerprint;  // see AreaTools::fingerprint
+    std::shared_ptr<Fmi::CoordinateMatrix> locations;
+  };
+
+  typedef std::list<AreaLocations> LocationCache;
+
   mutable std::shared_ptr<Fmi::CoordinateMatrix> itsLocations;
-  mutable std::shared_ptr<Fmi::CoordinateMatrix> itsLocationsWorldXY;
-  mutable std::shared_ptr<Fmi::CoordinateMatrix> itsLocationsXY;
-  mutable std::string itsLocationsArea;
+  mutable LocationCache itsLocationsWorldXY;  // most recently used first
+  mutable LocationCache itsLocationsXY;       // most recently used first
+
+  static std::shared_ptr<Fmi::CoordinateMatrix> FindLocations(LocationCache &theCache,
+                                                              const AreaLocations &theKey);
+  static void InsertLocations(LocationCache &theCache, const AreaLocations &theEntry);
+
+  typedef std::vector<std::pair<NFmiMetTime, unsigned long> > SortedTimes;
+  typedef std::vector<std::pair<float, unsigned long> > SortedLevels;
+
+  SortedTimes itsTimes;    // sorted by time
+  SortedLevels itsLevels;  // sorted by level value
+
+  void BuildIndex();
+
+  struct SliceKey
+  {
+    unsigned long param;
+    unsigned long level;
+    long long time;     // time index, or YYYYMMDDHHMM if interpolated
+    bool interpolated;  // requested time may be between data times
+
+    bool operator==(const SliceKey &theOther) const;
+  };
+
+  typedef std::list<std::pair<SliceKey, NFmiDataMatrix<float> > > SliceCache;
+
+  std::size_t itsSliceCacheSize;
+  SliceCache itsSlices;  // most recently used first
+
+  SliceKey CurrentSlice() const;
+  const NFmiDataMatrix<float> *FindSlice(const SliceKey &theKey);
+  NFmiDataMatrix<float> &NewSlice(const SliceKey &theKey);
 
 };  // class LazyQueryData
 
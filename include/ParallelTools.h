@@ -0,0 +1,30 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace ParallelTools
+ */
+// ======================================================================
+/*!
+ * \namespace ParallelTools
+ * \brief Tools for running independent tasks in parallel
+ *
+ */
+// ======================================================================
+
+#ifndef PARALLELTOOLS_H
+#define PARALLELTOOLS_H
+
+#include <cstddef>
+#include <functional>
+
+namespace ParallelTools
+{
+void run(std::size_t theTaskCount,
+         unsigned int theThreadCount,
+         const std::function<void(std::size_t)> &theTask);
+
+}  // namespace ParallelTools
+
+#endif  // PARALLELTOOLS_H
+
+// ======================================================================
@@ -0,0 +1,91 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class QueryDataPool
+ */
+// ======================================================================
+/*!
+ * \class QueryDataPool
+ * \brief Storage for querydata read during the process
+ *
+ * The purpose of the QueryDataPool is to let scripts switch between
+ * different lists of querydata files without reading the same file
+ * again. Each querydata is identified by its filename, and is reused
+ * only if the modification time and size of the file are unchanged.
+ *
+ * The pool may be given a memory budget, in which case the least
+ * recently used querydata are released whenever the combined size
+ * of the files exceeds the budget. Querydata still in use elsewhere
+ * are never released.
+ *
+ * Typical use is shown below.
+ * \code
+ * QueryDataPool pool;
+ *
+ * std::shared_ptr<LazyQueryData> data = pool.find(filename);
+ * if (!data)
+ * {
+ *   data.reset(new LazyQueryData());
+ *   data->Read(filename);
+ *   pool.insert(filename, data);
+ * }
+ * \endcode
+ */
+// ======================================================================
+
+#ifndef QUERYDATAPOOL_H
+#define QUERYDATAPOOL_H
+
+#include <cstddef>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+class LazyQueryData;
+
+class QueryDataPool
+{
+ private:
+  typedef std::list<const std::string *> order_type;
+
+  struct Entry
+  {
+    std::shared_ptr<LazyQueryData> data;
+    std::time_t modtime;
+    long filesize;
+    order_type::iterator position;
+  };
+
+  typedef std::map<std::string, Entry> storage_type;
+  storage_type itsData;
+  order_type itsOrder;  // most recently used first
+  std::size_t itsBytes;
+  std::size_t itsMaxBytes;
+  std::size_t itsReleases;
+
+  void erase(storage_type::iterator theEntry);
+
+ public:
+  typedef storage_type::size_type size_type;
+
+  QueryDataPool();
+
+  bool empty() const;
+  void clear();
+  size_type size() const;
+
+  void maxBytes(std::size_t theBytes);
+  std::size_t bytes() const { return itsBytes; }
+  std::size_t releases() const { return itsReleases; }
+
+  std::shared_ptr<LazyQueryData> find(const std::string &theFile);
+  void insert(const std::string &theFile, const std::shared_ptr<LazyQueryData> &theData);
+  void release();
+
+};  // class QueryDataPool
+
+#endif  // QUERYDATAPOOL_H
+
+// ======================================================================
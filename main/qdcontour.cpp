@@ -15,6 +15,7 @@
 #include "LazyQueryData.h"
 #include "MeridianTools.h"
 #include "MetaFunctions.h"
+#include "ParallelTools.h"
 #include "TimeTools.h"
 #include <boost/lexical_cast.hpp>
 #include <memory>
@@ -35,13 +36,21 @@
 #include <newbase/NFmiSettings.h>  // Configuration
 #include <newbase/NFmiSmoother.h>  // for smoothing data
 #include <newbase/NFmiStringTools.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #ifdef IMAGINE_WITH_CAIRO
 #include "ImagineXr.h"
@@ -73,6 +82,9 @@ FmiParameterName toparam(const string &name)
   }
   catch (...)
   {
+    // Images may be rendered in parallel
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
     return FmiParameterName(converter.ToEnum(name));
   }
 }
@@ -89,6 +101,7 @@ void Usage(void)
        << "   -h\tDisplay this help information" << endl
        << "   -v\tVerbose mode" << endl
        << "   -f\tForce overwriting old images" << endl
+       << "   -j [threads]\tNumber of threads used for contouring" << endl
        << "   -q [querydata]\tSpecify querydata to be rendered" << endl
        << "   -c \"config line\"\tPrecede with config line (i.e. \"format pdf\")" << endl
        << endl;
@@ -141,7 +154,7 @@ bool IsMasked(const NFmiPoint &thePoint, const std::string &theMask)
 
 void parse_command_line(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "hvfq!c!");
+  NFmiCmdLine cmdline(argc, argv, "hvfq!c!j!");
 
   // Check for parsing errors
 
@@ -169,6 +182,18 @@ void parse_command_line(int argc, const char *argv[])
   if (cmdline.isOption('q'))
     globals.cmdline_querydata = cmdline.OptionValue('q');
 
+  // Read -j option
+
+  if (cmdline.isOption('j'))
+  {
+    int threads = NFmiStringTools::Convert<int>(cmdline.OptionValue('j'));
+    if (threads < 1)
+      throw runtime_error("The -j option requires a positive number of threads");
+    globals.threads = threads;
+    globals.calculator.threads(globals.threads);
+    globals.maskcalculator.threads(globals.threads);
+  }
+
   // AKa 22-Aug-2008: Added for allowing "format pdf" enforcing (or any other
   //                  command) from the command line.
   //
@@ -308,12 +333,7 @@ bool set_level(LazyQueryData &theInfo, int theLevel)
     return true;
   }
   else
-  {
-    for (theInfo.ResetLevel(); theInfo.NextLevel();)
-      if (theInfo.Level()->LevelValue() == static_cast<unsigned int>(theLevel))
-        return true;
-    return false;
-  }
+    return theInfo.SetLevel(static_cast<float>(theLevel));
 }
 
 // ----------------------------------------------------------------------
@@ -355,12 +375,61 @@ void report_extrema(const string &theParam, float theMin, float theMax)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Write image to file with desired format
+ * \brief Reduce the colors of an image before saving
+ *
+ * The known palette is used if there is one and it is small enough,
+ * otherwise the colors are quantized from scratch.
  */
 // ----------------------------------------------------------------------
 
+static void reduce_colors(NFmiImage &theImage, const ColorPalette *thePalette)
+{
+  if (thePalette != 0 && thePalette->usable() && thePalette->size() > 0)
+    thePalette->reduce(theImage);
+  else
+    theImage.ReduceColors();
+}
+
 #ifdef IMAGINE_WITH_CAIRO
-static void write_image(const ImagineXr &xr)
+// The output settings change count, see scratch_image
+static std::atomic<unsigned int> imagemodes(0);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a scratch image for converting Cairo surfaces
+ *
+ * Each thread keeps its own image, which is reused as long as the
+ * size of the images and the output settings remain the same. The
+ * conversion overwrites all the pixels of the image.
+ */
+// ----------------------------------------------------------------------
+
+static NFmiImage &scratch_image(int theWidth, int theHeight)
+{
+  struct Scratch
+  {
+    unsigned int generation;
+    std::unique_ptr<NFmiImage> image;
+  };
+  static thread_local Scratch scratch = {0, std::unique_ptr<NFmiImage>()};
+
+  if (!scratch.image || scratch.image->Width() != theWidth ||
+      scratch.image->Height() != theHeight || scratch.generation != imagemodes)
+  {
+    scratch.image.reset(new NFmiImage(theWidth, theHeight));
+    scratch.generation = imagemodes;
+    globals.setImageModes(*scratch.image);
+  }
+  return *scratch.image;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write image to file with desired format
+ */
+// ----------------------------------------------------------------------
+
+static void write_image(const ImagineXr &xr, const ColorPalette *thePalette)
 {
   const string filename = xr.Filename();
   const string format = xr.Format();
@@ -380,46 +449,31 @@ static void write_image(const ImagineXr &xr)
     //
     // Both Cairo and NFmiImage use ARGB_32 format, but NFmiImage has A
     // as opaqueness (0..127, 0=transparent) while Cairo as alpha (0..255,
-    // 255=transparent).
+    // 255=transparent). The conversion is done directly into the pixels
+    // of a reused image, avoiding an intermediate buffer.
     //
-    unsigned n = xr.Width() * xr.Height();
-#if 0
-        NFmiColorTools::Color buf[n];   // does not compile with VC++
-        xr.NFmiColorBuf(buf);
-        NFmiImage img( xr.Width(), xr.Height(), buf );
-#else
-    NFmiImage img;
-    {
-      NFmiColorTools::Color *buf = new NFmiColorTools::Color[n];
-      xr.NFmiColorBuf(buf);
-      img = NFmiImage(xr.Width(), xr.Height(), buf);
-      delete[] buf;
-    }
-#endif
-    globals.setImageModes(img);
+    NFmiImage &img = scratch_image(xr.Width(), xr.Height());
+    xr.NFmiColorBuf(&img(0, 0));
 
     if (globals.reducecolors)
-      img.ReduceColors();
+      reduce_colors(img, thePalette);
 
     img.Write(filename, format);
   }
-
-  if (!globals.itsImageCacheOn)
-    globals.itsImageCache.clear();
 }
 #else
-static void write_image(NFmiImage &theImage, const string &theName, const string &theFormat)
+static void write_image(NFmiImage &theImage,
+                        const string &theName,
+                        const string &theFormat,
+                        const ColorPalette *thePalette)
 {
   if (globals.verbose)
     cout << "Writing '" << theName << "'" << endl;
 
   if (globals.reducecolors)
-    theImage.ReduceColors();
+    reduce_colors(theImage, thePalette);
 
   theImage.Write(theName, theFormat);
-
-  if (!globals.itsImageCacheOn)
-    globals.itsImageCache.clear();
 }
 #endif
 
@@ -472,6 +526,178 @@ void do_cache(istream &theInput)
   globals.maskcalculator.cache(flag != 0);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "contourcache" command
+ */
+// ----------------------------------------------------------------------
+
+void do_contourcache(istream &theInput)
+{
+  string option;
+  theInput >> option;
+
+  check_errors(theInput, "contourcache");
+
+  if (option == "maxbytes")
+  {
+    double bytes;
+    theInput >> bytes;
+
+    check_errors(theInput, "contourcache maxbytes");
+
+    if (bytes < 0)
+      throw runtime_error("contourcache maxbytes must be nonnegative");
+
+    globals.calculator.cacheMaxBytes(static_cast<std::size_t>(bytes));
+    globals.maskcalculator.cacheMaxBytes(static_cast<std::size_t>(bytes));
+  }
+  else if (option == "directory")
+  {
+    string directory;
+    theInput >> directory;
+
+    check_errors(theInput, "contourcache directory");
+
+    if (directory == "none")
+      directory.clear();
+
+    globals.calculator.cacheDirectory(directory);
+    globals.maskcalculator.cacheDirectory(directory);
+  }
+  else if (option == "maxdiskbytes")
+  {
+    double bytes;
+    theInput >> bytes;
+
+    check_errors(theInput, "contourcache maxdiskbytes");
+
+    if (bytes < 0)
+      throw runtime_error("contourcache maxdiskbytes must be nonnegative");
+
+    globals.calculator.cacheMaxDiskBytes(static_cast<std::uint64_t>(bytes));
+    globals.maskcalculator.cacheMaxDiskBytes(static_cast<std::uint64_t>(bytes));
+  }
+  else
+    throw runtime_error("Unknown contourcache option '" + option + "'");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "slicecache" command
+ */
+// ----------------------------------------------------------------------
+
+void do_slicecache(istream &theInput)
+{
+  int slices;
+  theInput >> slices;
+
+  check_errors(theInput, "slicecache");
+
+  if (slices < 0)
+    throw runtime_error("slicecache must be nonnegative");
+
+  globals.slicecache = slices;
+
+  for (auto &stream : globals.querystreams)
+    stream->SliceCacheSize(globals.slicecache);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "prefetch" command
+ */
+// ----------------------------------------------------------------------
+
+void do_prefetch(istream &theInput)
+{
+  int flag;
+  theInput >> flag;
+
+  check_errors(theInput, "prefetch");
+
+  globals.prefetch = (flag != 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "threads" command
+ */
+// ----------------------------------------------------------------------
+
+void do_threads(istream &theInput)
+{
+  int threads;
+  theInput >> threads;
+
+  check_errors(theInput, "threads");
+
+  if (threads < 1)
+    throw runtime_error("threads must be positive");
+
+  globals.threads = threads;
+  globals.calculator.threads(globals.threads);
+  globals.maskcalculator.threads(globals.threads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "imagethreads" command
+ */
+// ----------------------------------------------------------------------
+
+void do_imagethreads(istream &theInput)
+{
+  int threads;
+  theInput >> threads;
+
+  check_errors(theInput, "imagethreads");
+
+  if (threads < 1)
+    throw runtime_error("imagethreads must be positive");
+
+  globals.imagethreads = threads;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "writethreads" command
+ */
+// ----------------------------------------------------------------------
+
+void do_writethreads(istream &theInput)
+{
+  int threads;
+  theInput >> threads;
+
+  check_errors(theInput, "writethreads");
+
+  if (threads < 0)
+    throw runtime_error("writethreads must be nonnegative");
+
+  globals.imagewriter.threads(threads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "writequeue" command
+ */
+// ----------------------------------------------------------------------
+
+void do_writequeue(istream &theInput)
+{
+  int images;
+  theInput >> images;
+
+  check_errors(theInput, "writequeue");
+
+  if (images < 1)
+    throw runtime_error("writequeue must be positive");
+
+  globals.imagewriter.queueSize(images);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle the "imagecache" command
@@ -490,6 +716,14 @@ void do_imagecache(istream &theInput)
 #endif
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief The minimum number of threads used for reading querydata
+ */
+// ----------------------------------------------------------------------
+
+const unsigned int query_read_threads = 4;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle the "querydata" command
@@ -510,25 +744,132 @@ void do_querydata(istream &theInput)
     // Delete possible old infos
 
     globals.querystreams.clear();
+    globals.querystreamindex.clear();
 
     // Split the comma separated list into a real list
 
     vector<string> qnames = NFmiStringTools::Split(globals.queryfilelist);
 
-    // Read the queryfiles
+    // Reuse the querydata already read, if the files are unchanged
+
+    vector<string> filenames;
+    vector<std::shared_ptr<LazyQueryData>> streams;
+    vector<std::size_t> missing;
+
+    // A file listed twice is read only once
 
+    map<string, std::size_t> reading;
+    vector<pair<std::size_t, std::size_t>> duplicates;
+
+    vector<string>::const_iterator iter;
+    for (iter = qnames.begin(); iter != qnames.end(); ++iter)
     {
-      vector<string>::const_iterator iter;
-      for (iter = qnames.begin(); iter != qnames.end(); ++iter)
+      string filename = NFmiFileSystem::FileComplete(*iter, globals.datapath);
+      globals.queryfilenames.push_back(filename);
+      filenames.push_back(filename);
+      streams.push_back(globals.querypool.find(filename));
+      if (!streams.back())
       {
-        std::shared_ptr<LazyQueryData> tmp(new LazyQueryData());
-        string filename = NFmiFileSystem::FileComplete(*iter, globals.datapath);
-        globals.queryfilenames.push_back(filename);
-        tmp->Read(filename);
-        globals.querystreams.push_back(tmp);
+        const std::size_t index = streams.size() - 1;
+        map<string, std::size_t>::const_iterator pos = reading.find(filename);
+        if (pos == reading.end())
+        {
+          reading.insert(make_pair(filename, index));
+          missing.push_back(index);
+        }
+        else
+          duplicates.push_back(make_pair(index, pos->second));
       }
     }
+
+    // Read the rest in parallel. Reading is mostly waiting
+    // for the disk, hence a few threads are used even when
+    // contouring is sequential.
+
+    typedef std::chrono::steady_clock clock;
+
+    vector<clock::duration> durations(missing.size());
+
+    const clock::time_point start = clock::now();
+
+    ParallelTools::run(missing.size(),
+                       std::max(globals.threads, query_read_threads),
+                       [&](std::size_t i)
+                       {
+                         const clock::time_point t1 = clock::now();
+                         std::shared_ptr<LazyQueryData> tmp(new LazyQueryData());
+                         tmp->Read(filenames[missing[i]]);
+                         streams[missing[i]] = tmp;
+                         durations[i] = clock::now() - t1;
+                       });
+
+    const clock::duration elapsed = clock::now() - start;
+
+    // Store the new querydata into the pool
+
+    for (std::size_t i = 0; i < missing.size(); i++)
+      globals.querypool.insert(filenames[missing[i]], streams[missing[i]]);
+
+    for (std::size_t i = 0; i < duplicates.size(); i++)
+      streams[duplicates[i].first] = streams[duplicates[i].second];
+
+    for (std::size_t i = 0; i < streams.size(); i++)
+      streams[i]->SliceCacheSize(globals.slicecache);
+
+    globals.querystreams = streams;
+    globals.querypool.release();
+
+    if (globals.verbose)
+    {
+      clock::duration total = clock::duration::zero();
+      for (std::size_t i = 0; i < durations.size(); i++)
+        total += durations[i];
+
+      typedef std::chrono::duration<double, std::milli> ms;
+      const double wallclock = std::chrono::duration_cast<ms>(elapsed).count();
+      const double cumulative = std::chrono::duration_cast<ms>(total).count();
+
+      cout << "Read " << missing.size() << " querydata in " << wallclock
+           << " ms, the individual reads took " << cumulative << " ms";
+      if (wallclock > 0)
+        cout << " (speed-up " << cumulative / wallclock << ")";
+      cout << endl;
+
+      if (missing.size() < streams.size())
+        cout << "Reused " << streams.size() - missing.size() << " querydata read earlier" << endl;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "querydatapool" command
+ */
+// ----------------------------------------------------------------------
+
+void do_querydatapool(istream &theInput)
+{
+  string option;
+  theInput >> option;
+
+  check_errors(theInput, "querydatapool");
+
+  if (option == "maxbytes")
+  {
+    double bytes;
+    theInput >> bytes;
+
+    check_errors(theInput, "querydatapool maxbytes");
+
+    if (bytes < 0)
+      throw runtime_error("querydatapool maxbytes must be nonnegative");
+
+    globals.querypool.maxBytes(static_cast<std::size_t>(bytes));
   }
+  else if (option == "clear")
+    globals.querypool.clear();
+  else
+    throw runtime_error("Unknown querydatapool option '" + option + "'");
 }
 
 // ----------------------------------------------------------------------
@@ -1405,6 +1746,26 @@ void do_format(istream &theInput)
   }
 #endif
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for the pending images to be written
+ *
+ * The images are encoded using the output settings in effect when
+ * they are written, hence the settings may be changed only once
+ * the pending images have been written. The recycled images are
+ * renewed for the same reason.
+ */
+// ----------------------------------------------------------------------
+
+void finish_writing()
+{
+  globals.imagewriter.wait();
+  globals.imagepool.clear();
+#ifdef IMAGINE_WITH_CAIRO
+  ++imagemodes;
+#endif
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle "gamma" command
@@ -1413,6 +1774,8 @@ void do_format(istream &theInput)
 
 void do_gamma(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.gamma;
 
   check_errors(theInput, "gamma");
@@ -1426,6 +1789,8 @@ void do_gamma(istream &theInput)
 
 void do_intent(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.intent;
 
   check_errors(theInput, "intent");
@@ -1439,6 +1804,8 @@ void do_intent(istream &theInput)
 
 void do_pngquality(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.pngquality;
 
   check_errors(theInput, "pngquality");
@@ -1452,6 +1819,8 @@ void do_pngquality(istream &theInput)
 
 void do_jpegquality(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.jpegquality;
 
   check_errors(theInput, "jpegquality");
@@ -1465,6 +1834,8 @@ void do_jpegquality(istream &theInput)
 
 void do_savealpha(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.savealpha;
 
   check_errors(theInput, "savealpha");
@@ -1478,11 +1849,28 @@ void do_savealpha(istream &theInput)
 
 void do_reducecolors(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.reducecolors;
 
   check_errors(theInput, "reducecolors");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "knownpalette" command
+ */
+// ----------------------------------------------------------------------
+
+void do_knownpalette(istream &theInput)
+{
+  finish_writing();
+
+  theInput >> globals.knownpalette;
+
+  check_errors(theInput, "knownpalette");
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle "wantpalette" command
@@ -1491,6 +1879,8 @@ void do_reducecolors(istream &theInput)
 
 void do_wantpalette(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.wantpalette;
 
   check_errors(theInput, "wantpalette");
@@ -1504,6 +1894,8 @@ void do_wantpalette(istream &theInput)
 
 void do_forcepalette(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.forcepalette;
 
   check_errors(theInput, "forcepalette");
@@ -1517,6 +1909,8 @@ void do_forcepalette(istream &theInput)
 
 void do_alphalimit(istream &theInput)
 {
+  finish_writing();
+
   theInput >> globals.alphalimit;
 
   check_errors(theInput, "alphalimit");
@@ -1679,6 +2073,61 @@ void do_contourtriangles(istream &theInput)
   check_errors(theInput, "contourtriangles");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "contourtilesize" command
+ */
+// ----------------------------------------------------------------------
+
+void do_contourtilesize(istream &theInput)
+{
+  int tilesize;
+  theInput >> tilesize;
+
+  check_errors(theInput, "contourtilesize");
+
+  if (tilesize < 0)
+    throw runtime_error("contourtilesize must be nonnegative");
+
+  globals.calculator.tileSize(tilesize);
+  globals.maskcalculator.tileSize(tilesize);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "contourviewport" command
+ */
+// ----------------------------------------------------------------------
+
+void do_contourviewport(istream &theInput)
+{
+  int flag;
+  theInput >> flag;
+
+  check_errors(theInput, "contourviewport");
+
+  globals.contourviewport = (flag != 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "contourviewportmargin" command
+ */
+// ----------------------------------------------------------------------
+
+void do_contourviewportmargin(istream &theInput)
+{
+  int margin;
+  theInput >> margin;
+
+  check_errors(theInput, "contourviewportmargin");
+
+  if (margin < 0)
+    throw runtime_error("contourviewportmargin must be nonnegative");
+
+  globals.contourviewportmargin = margin;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle "smoother" command
@@ -2703,6 +3152,8 @@ void do_clear(istream &theInput)
   {
     globals.calculator.clearCache();
     globals.maskcalculator.clearCache();
+    for (unsigned int i = 0; i < globals.imagecalculators.size(); i++)
+      globals.imagecalculators[i]->clearCache();
   }
   else if (command == "imagecache")
   {
@@ -2804,10 +3255,13 @@ void do_draw_shapes(istream &theInput)
   }
 
 #ifdef IMAGINE_WITH_CAIRO
-  write_image(image);
+  write_image(image, 0);
 #else
-  write_image(image, filename + '.' + globals.format, globals.format);
+  write_image(image, filename + '.' + globals.format, globals.format, 0);
 #endif
+
+  if (!globals.itsImageCacheOn)
+    globals.itsImageCache.clear();
 }
 
 // ----------------------------------------------------------------------
@@ -2907,18 +3361,67 @@ int paramid(const string &theParam)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Choose the queryinfo from the set of available datas
+ * \brief Find the queryinfo containing the given parameter and level
+ *
+ * The result is memoized in the given index, so that the datas are
+ * searched only once for each parameter and level. The levels of the
+ * searched datas are left unchanged. A negative level value implies
+ * the first level in the data.
+ *
+ * \return The data and level indices, or 0 if not found
  */
 // ----------------------------------------------------------------------
 
-unsigned int choose_queryinfo(const string &theName, int theLevel)
+const Globals::StreamIndex::mapped_type *find_stream(
+    const vector<std::shared_ptr<LazyQueryData>> &theStreams,
+    Globals::StreamIndex &theIndex,
+    FmiParameterName theParam,
+    int theLevel)
 {
-  if (globals.querystreams.size() == 0)
-    throw runtime_error("No querydata has been specified");
+  const Globals::StreamIndex::key_type key(theParam, theLevel < 0 ? -1 : theLevel);
 
-  if (MetaFunctions::isMeta(theName))
+  Globals::StreamIndex::const_iterator it = theIndex.find(key);
+  if (it != theIndex.end())
+    return &it->second;
+
+  for (unsigned int qi = 0; qi < theStreams.size(); qi++)
+  {
+    LazyQueryData &info = *theStreams[qi];
+    info.Param(theParam);
+    if (info.IsParamUsable())
+    {
+      const unsigned long oldlevel = info.LevelIndex();
+      const bool found = set_level(info, theLevel);
+      const unsigned long level = info.LevelIndex();
+      info.LevelIndex(oldlevel);
+
+      if (found)
+        return &(theIndex[key] = make_pair(qi, level));
+    }
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Choose the queryinfo from the set of available datas
+ *
+ * Sets the parameter and level of the chosen data.
+ *
+ * \return The index of the chosen data
+ */
+// ----------------------------------------------------------------------
+
+unsigned int choose_stream(const vector<std::shared_ptr<LazyQueryData>> &theStreams,
+                           Globals::StreamIndex &theIndex,
+                           const string &theName,
+                           int theLevel)
+{
+  if (theStreams.size() == 0)
+    throw runtime_error("No querydata has been specified");
+
+  if (MetaFunctions::isMeta(theName))
   {
-    globals.queryinfo = globals.querystreams[0];
     return 0;
   }
   else
@@ -2927,16 +3430,17 @@ unsigned int choose_queryinfo(const string &theName, int theLevel)
 
     FmiParameterName param = toparam(theName);
 
-    for (unsigned int qi = 0; qi < globals.querystreams.size(); qi++)
+    const Globals::StreamIndex::mapped_type *stream =
+        find_stream(theStreams, theIndex, param, theLevel);
+
+    if (stream != 0)
     {
-      globals.queryinfo = globals.querystreams[qi];
-      globals.queryinfo->Param(param);
-      if (globals.queryinfo->IsParamUsable())
-      {
-        if (set_level(*globals.queryinfo, theLevel))
-          return qi;
-      }
+      LazyQueryData &info = *theStreams[stream->first];
+      info.Param(param);
+      info.LevelIndex(stream->second);
+      return stream->first;
     }
+
     if (theLevel < 0)
       throw runtime_error("Parameter '" + theName + "' is not available in the query files");
     else
@@ -2946,6 +3450,66 @@ unsigned int choose_queryinfo(const string &theName, int theLevel)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief The state modified while rendering an image
+ *
+ * Normally the context refers to the global state. When rendering
+ * several images in parallel, each image has its own data cursors,
+ * contourer, specifications and label locators.
+ */
+// ----------------------------------------------------------------------
+
+struct RenderContext
+{
+  std::vector<std::shared_ptr<LazyQueryData>> &querystreams;
+  Globals::StreamIndex &querystreamindex;
+  std::shared_ptr<LazyQueryData> &queryinfo;
+  ContourCalculator &calculator;
+  std::list<ContourSpec> &specs;
+  LabelLocator &labellocator;
+  LabelLocator &symbollocator;
+  LabelLocator &imagelocator;
+  ExtremaLocator &pressurelocator;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The render context referring to the global state
+ */
+// ----------------------------------------------------------------------
+
+RenderContext global_context()
+{
+  RenderContext context = {globals.querystreams,
+                           globals.querystreamindex,
+                           globals.queryinfo,
+                           globals.calculator,
+                           globals.specs,
+                           globals.labellocator,
+                           globals.symbollocator,
+                           globals.imagelocator,
+                           globals.pressurelocator};
+  return context;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Choose the queryinfo which contains the given parameter
+ *
+ * Sets the active queryinfo, its parameter and level.
+ *
+ * \return The index of the queryinfo
+ */
+// ----------------------------------------------------------------------
+
+unsigned int choose_queryinfo(RenderContext &ctx, const string &theName, int theLevel)
+{
+  unsigned int qi = choose_stream(ctx.querystreams, ctx.querystreamindex, theName, theLevel);
+  ctx.queryinfo = ctx.querystreams[qi];
+  return qi;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Expand the data values
@@ -2983,13 +3547,90 @@ void expand_data(NFmiDataMatrix<float> &theValues)
     }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Restrict contouring to the grid cells visible in the image
+ *
+ * The window is the bounding box of the grid points inside the
+ * world rectangle of the area, expanded by the viewport margin.
+ * The full grid is used if the window would not be any smaller.
+ *
+ * \param theCalculator The calculator whose data has been set
+ * \param theArea The area being rendered
+ * \param thePoints The world coordinates of the grid points
+ * \param theValues The data being contoured
+ */
+// ----------------------------------------------------------------------
+
+void set_contour_window(ContourCalculator &theCalculator,
+                        const NFmiArea &theArea,
+                        const LazyCoordinates &thePoints,
+                        const NFmiDataMatrix<float> &theValues)
+{
+  const std::size_t nx = theValues.NX();
+  const std::size_t ny = theValues.NY();
+
+  // Reshaped data cannot be matched with the grid
+
+  if (thePoints.NX() != nx || thePoints.NY() != ny)
+    return;
+
+  const NFmiRect rect = theArea.WorldRect();
+  const double xmin = min(rect.Left(), rect.Right());
+  const double xmax = max(rect.Left(), rect.Right());
+  const double ymin = min(rect.Top(), rect.Bottom());
+  const double ymax = max(rect.Top(), rect.Bottom());
+
+  std::size_t i1 = nx, j1 = ny, i2 = 0, j2 = 0;
+
+  for (std::size_t j = 0; j < ny; j++)
+    for (std::size_t i = 0; i < nx; i++)
+    {
+      const NFmiPoint xy = thePoints(i, j);
+      if (xy.X() >= xmin && xy.X() <= xmax && xy.Y() >= ymin && xy.Y() <= ymax)
+      {
+        i1 = min(i1, i);
+        i2 = max(i2, i);
+        j1 = min(j1, j);
+        j2 = max(j2, j);
+      }
+    }
+
+  // Nothing visible means something odd such as a global grid which
+  // wraps around the area, in which case we play it safe
+
+  if (i1 > i2 || j1 > j2)
+    return;
+
+  const std::size_t margin = globals.contourviewportmargin;
+  i1 = (i1 > margin ? i1 - margin : 0);
+  j1 = (j1 > margin ? j1 - margin : 0);
+  i2 = min(i2 + margin, nx - 1);
+  j2 = min(j2 + margin, ny - 1);
+
+  if (i2 - i1 < 1 || j2 - j1 < 1)
+    return;
+
+  if (i1 == 0 && j1 == 0 && i2 == nx - 1 && j2 == ny - 1)
+    return;
+
+  theCalculator.window(i1, j1, i2, j2);
+
+  if (globals.verbose)
+    cout << "Contouring grid window " << i1 << ',' << j1 << " - " << i2 << ',' << j2 << " of "
+         << nx << 'x' << ny << endl;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Filter the data values
+ *
+ * The data is left at the time it was given in.
  */
 // ----------------------------------------------------------------------
 
-void filter_values(NFmiDataMatrix<float> &theValues,
+void filter_values(LazyQueryData &theData,
+                   NFmiDataMatrix<float> &theValues,
                    const NFmiTime &theTime,
                    const ContourSpec &theSpec)
 {
@@ -2999,23 +3640,24 @@ void filter_values(NFmiDataMatrix<float> &theValues,
   }
   else if (globals.filter == "linear")
   {
-    NFmiTime tnow = globals.queryinfo->ValidTime();
+    NFmiTime tnow = theData.ValidTime();
     bool isexact = theTime.IsEqual(tnow);
 
     if (!isexact)
     {
       NFmiDataMatrix<float> tmpvals;
-      NFmiTime t2 = globals.queryinfo->ValidTime();
-      globals.queryinfo->PreviousTime();
-      NFmiTime t1 = globals.queryinfo->ValidTime();
+      NFmiTime t2 = theData.ValidTime();
+      theData.PreviousTime();
+      NFmiTime t1 = theData.ValidTime();
       if (!MetaFunctions::isMeta(theSpec.param()))
       {
-        tmpvals = globals.queryinfo->Values();
-        globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()),
-                                       tmpvals);
+        tmpvals = theData.Values();
+        globals.unitsconverter.convert(FmiParameterName(theData.GetParamIdent()), tmpvals);
       }
       else
-        tmpvals = MetaFunctions::values(theSpec.param(), *globals.queryinfo);
+        tmpvals = MetaFunctions::values(theSpec.param(), theData);
+      theData.SetTime(t2);
+
       if (theSpec.replace())
         tmpvals.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
 
@@ -3042,8 +3684,8 @@ void filter_values(NFmiDataMatrix<float> &theValues,
     int steps = 1;
     for (;;)
     {
-      tmpvals = globals.queryinfo->Values(tnow);
-      globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), tmpvals);
+      theData.Values(tmpvals, tnow);
+      globals.unitsconverter.convert(FmiParameterName(theData.GetParamIdent()), tmpvals);
 
       if (theSpec.replace())
         tmpvals.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
@@ -3073,6 +3715,92 @@ void filter_values(NFmiDataMatrix<float> &theValues,
   theSpec.despeckle(theValues);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the values to be contoured for a parameter
+ *
+ * The data must already be set to the parameter, level and time
+ * of the image. The values are converted, replaced, filtered,
+ * expanded and smoothened as requested by the specification.
+ *
+ * Uses only the given data and read-only settings, and may
+ * hence be called from another thread with a cloned data. The
+ * data is left at the time it was given in.
+ */
+// ----------------------------------------------------------------------
+
+void extract_values(LazyQueryData &theData,
+                    NFmiDataMatrix<float> &theValues,
+                    const NFmiTime &theTime,
+                    const ContourSpec &theSpec,
+                    const NFmiArea &theArea)
+{
+  // Get the values.
+
+  if (!MetaFunctions::isMeta(theSpec.param()))
+  {
+    theData.Values(theValues);
+    globals.unitsconverter.convert(FmiParameterName(theData.GetParamIdent()), theValues);
+  }
+  else
+    theValues = MetaFunctions::values(theSpec.param(), theData);
+
+  // Replace values if so requested
+
+  if (theSpec.replace())
+    theValues.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
+
+  // Filter the values if so requested
+
+  filter_values(theData, theValues, theTime, theSpec);
+
+  // Expand the data if so requested
+
+  if (globals.expanddata)
+    expand_data(theValues);
+
+  // Call smoother only if necessary to avoid dereferencing coordinates
+
+  if (theSpec.smoother() != "None")
+  {
+    NFmiSmoother smoother(theSpec.smoother(), theSpec.smootherFactor(), theSpec.smootherRadius());
+
+    theValues = smoother.Smoothen(*theData.LocationsWorldXY(theArea), theValues);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the values of all parameters for the given time
+ *
+ * This is run in a worker thread while the previous image is being
+ * rendered, and hence uses only its own clones of the data, the
+ * specifications and the area.
+ */
+// ----------------------------------------------------------------------
+
+vector<NFmiDataMatrix<float>> prefetch_values(
+    const vector<std::shared_ptr<LazyQueryData>> &theStreams,
+    Globals::StreamIndex &theIndex,
+    const list<ContourSpec> &theSpecs,
+    const NFmiTime &theTime,
+    const NFmiArea &theArea)
+{
+  vector<NFmiDataMatrix<float>> values(theSpecs.size());
+
+  for (unsigned int qi = 0; qi < theStreams.size(); qi++)
+    theStreams[qi]->SetTimeAtOrAfter(theTime);
+
+  vector<NFmiDataMatrix<float>>::iterator vit = values.begin();
+  for (list<ContourSpec>::const_iterator it = theSpecs.begin(); it != theSpecs.end(); ++it, ++vit)
+  {
+    const unsigned int qi = choose_stream(theStreams, theIndex, it->param(), it->level());
+    extract_values(*theStreams[qi], *vit, theTime, *it, theArea);
+  }
+
+  return values;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Save grid values for later labelling
@@ -3127,7 +3855,8 @@ void add_label_grid_values(ContourSpec &theSpec,
  */
 // ----------------------------------------------------------------------
 
-void add_label_pixelgrid_values(ContourSpec &theSpec,
+void add_label_pixelgrid_values(RenderContext &ctx,
+                                ContourSpec &theSpec,
                                 const NFmiArea &theArea,
                                 const ImagineXr_or_NFmiImage &img,
                                 const NFmiDataMatrix<float> &theValues)
@@ -3145,7 +3874,7 @@ void add_label_pixelgrid_values(ContourSpec &theSpec,
       for (float x = x0; x <= img.Width(); x += dx)
       {
         NFmiPoint latlon = theArea.ToLatLon(NFmiPoint(x, y));
-        NFmiPoint ij = globals.queryinfo->LatLonToGrid(latlon);
+        NFmiPoint ij = ctx.queryinfo->LatLonToGrid(latlon);
 
         int i = static_cast<int>(ij.X());  // rounds down
         int j = static_cast<int>(ij.Y());
@@ -3168,7 +3897,8 @@ void add_label_pixelgrid_values(ContourSpec &theSpec,
  */
 // ----------------------------------------------------------------------
 
-void add_label_point_values(ContourSpec &theSpec,
+void add_label_point_values(RenderContext &ctx,
+                            ContourSpec &theSpec,
                             const NFmiArea &theArea,
                             const NFmiDataMatrix<float> &theValues)
 {
@@ -3180,7 +3910,7 @@ void add_label_point_values(ContourSpec &theSpec,
     for (it = theSpec.labelPoints().begin(); it != theSpec.labelPoints().end(); ++it)
     {
       NFmiPoint latlon = it->first;
-      NFmiPoint ij = globals.queryinfo->LatLonToGrid(latlon);
+      NFmiPoint ij = ctx.queryinfo->LatLonToGrid(latlon);
 
       int i = static_cast<int>(ij.X());  // rounds down
       int j = static_cast<int>(ij.Y());
@@ -3594,7 +4324,8 @@ void draw_roundarrow(NFmiImage &img, const NFmiPoint &xy, float speed, float ang
  */
 // ----------------------------------------------------------------------
 
-void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
+void get_speed_direction(RenderContext &ctx,
+                         const Fmi::CoordinateTransformation &transformation,
                          float speed_src,
                          float speed_dst,
                          float direction_src,
@@ -3604,19 +4335,18 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
 {
   if (!globals.directionparam.empty())
   {
-    if (globals.queryinfo->Param(toparam(globals.speedparam)))
+    if (ctx.queryinfo->Param(toparam(globals.speedparam)))
     {
-      speed = globals.queryinfo->Values();
+      ctx.queryinfo->Values(speed);
       speed.Replace(speed_src, speed_dst);
-      globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), speed);
+      globals.unitsconverter.convert(FmiParameterName(ctx.queryinfo->GetParamIdent()), speed);
     }
 
-    if (globals.queryinfo->Param(toparam(globals.directionparam)))
+    if (ctx.queryinfo->Param(toparam(globals.directionparam)))
     {
-      direction = globals.queryinfo->Values();
+      ctx.queryinfo->Values(direction);
       direction.Replace(direction_src, direction_dst);
-      globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()),
-                                     direction);
+      globals.unitsconverter.convert(FmiParameterName(ctx.queryinfo->GetParamIdent()), direction);
     }
   }
   else
@@ -3624,12 +4354,12 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
     NFmiDataMatrix<float> dx;
     NFmiDataMatrix<float> dy;
 
-    if (globals.queryinfo->Param(toparam(globals.speedxcomponent)))
-      dx = globals.queryinfo->Values();
-    if (globals.queryinfo->Param(toparam(globals.speedycomponent)))
-      dy = globals.queryinfo->Values();
+    if (ctx.queryinfo->Param(toparam(globals.speedxcomponent)))
+      dx = ctx.queryinfo->Values();
+    if (ctx.queryinfo->Param(toparam(globals.speedycomponent)))
+      dy = ctx.queryinfo->Values();
 
-    auto latlon = globals.queryinfo->Locations();
+    auto latlon = ctx.queryinfo->Locations();
 
     if (dx.NX() != 0 && dx.NY() != 0 && dy.NX() != 0 && dy.NY() != 0)
     {
@@ -3665,7 +4395,8 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
  */
 // ----------------------------------------------------------------------
 
-void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
+void get_speed_direction(RenderContext &ctx,
+                         const Fmi::CoordinateTransformation &transformation,
                          const NFmiPoint &latlon,
                          float speed_src,
                          float speed_dst,
@@ -3678,25 +4409,25 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
 
   if (!globals.directionparam.empty())
   {
-    if (globals.queryinfo->Param(toparam(globals.directionparam)))
+    if (ctx.queryinfo->Param(toparam(globals.directionparam)))
     {
-      direction = globals.queryinfo->InterpolatedValue(latlon);
+      direction = ctx.queryinfo->InterpolatedValue(latlon);
       if (direction == direction_src)
         direction = direction_dst;
 
       direction = globals.unitsconverter.convert(
-          FmiParameterName(globals.queryinfo->GetParamIdent()), direction);
+          FmiParameterName(ctx.queryinfo->GetParamIdent()), direction);
     }
 
-    if (globals.queryinfo->Param(toparam(globals.speedparam)))
+    if (ctx.queryinfo->Param(toparam(globals.speedparam)))
     {
-      speed = globals.queryinfo->InterpolatedValue(latlon);
+      speed = ctx.queryinfo->InterpolatedValue(latlon);
       if (speed == speed_src)
         speed = speed_dst;
-      speed = globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()),
+      speed = globals.unitsconverter.convert(FmiParameterName(ctx.queryinfo->GetParamIdent()),
                                              speed);
     }
-    globals.queryinfo->Param(toparam(globals.directionparam));
+    ctx.queryinfo->Param(toparam(globals.directionparam));
   }
 
   else
@@ -3704,10 +4435,10 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
     float dx = kFloatMissing;
     float dy = kFloatMissing;
 
-    if (globals.queryinfo->Param(toparam(globals.speedxcomponent)))
-      dx = globals.queryinfo->InterpolatedValue(latlon);
-    if (globals.queryinfo->Param(toparam(globals.speedycomponent)))
-      dy = globals.queryinfo->InterpolatedValue(latlon);
+    if (ctx.queryinfo->Param(toparam(globals.speedxcomponent)))
+      dx = ctx.queryinfo->InterpolatedValue(latlon);
+    if (ctx.queryinfo->Param(toparam(globals.speedycomponent)))
+      dy = ctx.queryinfo->InterpolatedValue(latlon);
 
     if (dx != kFloatMissing && dy != kFloatMissing)
     {
@@ -3735,7 +4466,8 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
  */
 // ----------------------------------------------------------------------
 
-void draw_wind_arrows_points(ImagineXr_or_NFmiImage &img,
+void draw_wind_arrows_points(RenderContext &ctx,
+                             ImagineXr_or_NFmiImage &img,
                              const NFmiArea &theArea,
                              const NFmiPath &theArrow,
                              float direction_src,
@@ -3763,8 +4495,15 @@ void draw_wind_arrows_points(ImagineXr_or_NFmiImage &img,
 
     float dir, speed;
 
-    get_speed_direction(
-        transformation, latlon, speed_src, speed_dst, direction_src, direction_dst, speed, dir);
+    get_speed_direction(ctx,
+                        transformation,
+                        latlon,
+                        speed_src,
+                        speed_dst,
+                        direction_src,
+                        direction_dst,
+                        speed,
+                        dir);
 
     // Ignore missing values
     if (dir == kFloatMissing || speed == kFloatMissing)
@@ -3847,7 +4586,8 @@ void draw_wind_arrows_points(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_wind_arrows_grid(ImagineXr_or_NFmiImage &img,
+void draw_wind_arrows_grid(RenderContext &ctx,
+                           ImagineXr_or_NFmiImage &img,
                            const NFmiArea &theArea,
                            const NFmiPath &theArrow,
                            float direction_src,
@@ -3864,7 +4604,8 @@ void draw_wind_arrows_grid(ImagineXr_or_NFmiImage &img,
 
   Fmi::CoordinateTransformation wgs84transformation("WGS84", theArea.SpatialReference());
 
-  get_speed_direction(wgs84transformation,
+  get_speed_direction(ctx,
+                      wgs84transformation,
                       speed_src,
                       speed_dst,
                       direction_src,
@@ -3881,16 +4622,16 @@ void draw_wind_arrows_grid(ImagineXr_or_NFmiImage &img,
 
   // Data coordinates to target area worldxy coordinates
 
-  auto coordinates = globals.queryinfo->CoordinateMatrix();
+  auto coordinates = ctx.queryinfo->CoordinateMatrix();
 
-  Fmi::CoordinateTransformation transformation(globals.queryinfo->SpatialReference(),
+  Fmi::CoordinateTransformation transformation(ctx.queryinfo->SpatialReference(),
                                                theArea.SpatialReference());
 
   if (!coordinates.transform(transformation))
     return;
 
   // Needed for grid to latlon conversions
-  const auto *grid = globals.queryinfo->Grid();
+  const auto *grid = ctx.queryinfo->Grid();
 
   for (float y = 0; y < coordinates.height() - 1; y += globals.windarrowdy)
     for (float x = 0; x < coordinates.width() - 1; x += globals.windarrowdx)
@@ -4022,7 +4763,8 @@ void draw_wind_arrows_grid(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_wind_arrows_pixelgrid(ImagineXr_or_NFmiImage &img,
+void draw_wind_arrows_pixelgrid(RenderContext &ctx,
+                                ImagineXr_or_NFmiImage &img,
                                 const NFmiArea &theArea,
                                 const NFmiPath &theArrow,
                                 float direction_src,
@@ -4054,8 +4796,15 @@ void draw_wind_arrows_pixelgrid(ImagineXr_or_NFmiImage &img,
 
       float dir, speed;
 
-      get_speed_direction(
-          transformation, latlon, speed_src, speed_dst, direction_src, direction_dst, speed, dir);
+      get_speed_direction(ctx,
+                          transformation,
+                          latlon,
+                          speed_src,
+                          speed_dst,
+                          direction_src,
+                          direction_dst,
+                          speed,
+                          dir);
 
       // Ignore missing values
 
@@ -4139,7 +4888,7 @@ void draw_wind_arrows_pixelgrid(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
+void draw_wind_arrows(RenderContext &ctx, ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
 {
   if ((!globals.arrowpoints.empty() || (globals.windarrowdx > 0 && globals.windarrowdy > 0) ||
        (globals.windarrowsxydx > 0 && globals.windarrowsxydy > 0)) &&
@@ -4161,21 +4910,18 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
     if (param == kFmiBadParameter)
       throw runtime_error("Unknown parameter " + name);
 
-    // Find the proper queryinfo to be used
+    // Find the proper queryinfo to be used. Any level will do,
+    // the level of the data is not changed.
 
-    bool ok = false;
-    for (unsigned int qi = 0; qi < globals.querystreams.size(); qi++)
-    {
-      globals.queryinfo = globals.querystreams[qi];
-      globals.queryinfo->Param(param);
-      ok = globals.queryinfo->IsParamUsable();
-      if (ok)
-        break;
-    }
+    const Globals::StreamIndex::mapped_type *stream =
+        find_stream(ctx.querystreams, ctx.querystreamindex, param, -1);
 
-    if (!ok)
+    if (stream == 0)
       throw runtime_error("Parameter is not usable: " + name);
 
+    ctx.queryinfo = ctx.querystreams[stream->first];
+    ctx.queryinfo->Param(param);
+
     // Read the arrow definition
 
     NFmiPath arrowpath;
@@ -4188,8 +4934,8 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
     // Establish data replacement values
 
     list<ContourSpec>::iterator piter;
-    list<ContourSpec>::iterator pbegin = globals.specs.begin();
-    list<ContourSpec>::iterator pend = globals.specs.end();
+    list<ContourSpec>::iterator pbegin = ctx.specs.begin();
+    list<ContourSpec>::iterator pend = ctx.specs.end();
 
     float direction_src = kFloatMissing;
     float direction_dst = kFloatMissing;
@@ -4211,11 +4957,11 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
     }
 
     draw_wind_arrows_points(
-        img, theArea, arrowpath, direction_src, direction_dst, speed_src, speed_dst);
+        ctx, img, theArea, arrowpath, direction_src, direction_dst, speed_src, speed_dst);
     draw_wind_arrows_grid(
-        img, theArea, arrowpath, direction_src, direction_dst, speed_src, speed_dst);
+        ctx, img, theArea, arrowpath, direction_src, direction_dst, speed_src, speed_dst);
     draw_wind_arrows_pixelgrid(
-        img, theArea, arrowpath, direction_src, direction_dst, speed_src, speed_dst);
+        ctx, img, theArea, arrowpath, direction_src, direction_dst, speed_src, speed_dst);
   }
 }
 
@@ -4225,7 +4971,8 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_fills(ImagineXr_or_NFmiImage &img,
+void draw_contour_fills(RenderContext &ctx,
+                        ImagineXr_or_NFmiImage &img,
                         const NFmiArea &theArea,
                         const ContourSpec &theSpec,
                         const NFmiTime &theTime,
@@ -4238,25 +4985,35 @@ void draw_contour_fills(ImagineXr_or_NFmiImage &img,
   begin = theSpec.contourFills().begin();
   end = theSpec.contourFills().end();
 
+  // Contour the actual data for all ranges at once
+
+  ContourCalculator::Limits limits;
   for (it = begin; it != end; ++it)
-  {
-    // Contour the actual data
+    limits.push_back(make_pair(it->lolimit(), it->hilimit()));
 
-    if (globals.verbose)
-      cout << "Calculating " << it->lolimit() << " - " << it->hilimit() << endl;
+  vector<NFmiPath> paths =
+      ctx.calculator.contour(*ctx.queryinfo, limits, theTime, theInterpolation, theArea);
+  const ContourCalculator::CacheStates states = ctx.calculator.cacheStates();
 
-    NFmiPath path = globals.calculator.contour(
-        *globals.queryinfo, it->lolimit(), it->hilimit(), theTime, theInterpolation);
+  vector<NFmiPath>::iterator pathiter = paths.begin();
+  ContourCalculator::CacheStates::const_iterator stateiter = states.begin();
+  for (it = begin; it != end; ++it, ++pathiter, ++stateiter)
+  {
+    NFmiPath &path = *pathiter;
 
-    if (globals.verbose && globals.calculator.wasCached())
-      cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
+    if (globals.verbose)
+    {
+      if (*stateiter != ContourCalculator::NotCached)
+        cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
+      else
+        cout << "Calculating " << it->lolimit() << " - " << it->hilimit() << endl;
+    }
 
     // Avoid unnecessary work if the path is empty
     if (path.Empty() && it->lolimit() != kFloatMissing && it->hilimit() != kFloatMissing)
       continue;
 
     // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
     invert_if_missing(path, it->lolimit(), it->hilimit());
 
     NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
@@ -4271,7 +5028,8 @@ void draw_contour_fills(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_patterns(ImagineXr_or_NFmiImage &img,
+void draw_contour_patterns(RenderContext &ctx,
+                           ImagineXr_or_NFmiImage &img,
                            const NFmiArea &theArea,
                            const ContourSpec &theSpec,
                            const NFmiTime &theTime,
@@ -4284,19 +5042,27 @@ void draw_contour_patterns(ImagineXr_or_NFmiImage &img,
   begin = theSpec.contourPatterns().begin();
   end = theSpec.contourPatterns().end();
 
+  ContourCalculator::Limits limits;
   for (it = begin; it != end; ++it)
+    limits.push_back(make_pair(it->lolimit(), it->hilimit()));
+
+  vector<NFmiPath> paths =
+      ctx.calculator.contour(*ctx.queryinfo, limits, theTime, theInterpolation, theArea);
+  const ContourCalculator::CacheStates states = ctx.calculator.cacheStates();
+
+  vector<NFmiPath>::iterator pathiter = paths.begin();
+  ContourCalculator::CacheStates::const_iterator stateiter = states.begin();
+  for (it = begin; it != end; ++it, ++pathiter, ++stateiter)
   {
-    NFmiPath path = globals.calculator.contour(
-        *globals.queryinfo, it->lolimit(), it->hilimit(), theTime, theInterpolation);
+    NFmiPath &path = *pathiter;
 
-    if (globals.verbose && globals.calculator.wasCached())
+    if (globals.verbose && *stateiter != ContourCalculator::NotCached)
       cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
 
     NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
     const ImagineXr_or_NFmiImage &pattern = globals.getImage(it->pattern());
 
     // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
     invert_if_missing(path, it->lolimit(), it->hilimit());
 
     path.Fill(img, pattern, rule, it->factor());
@@ -4309,7 +5075,8 @@ void draw_contour_patterns(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_strokes(ImagineXr_or_NFmiImage &img,
+void draw_contour_strokes(RenderContext &ctx,
+                          ImagineXr_or_NFmiImage &img,
                           const NFmiArea &theArea,
                           const ContourSpec &theSpec,
                           const NFmiTime &theTime,
@@ -4322,18 +5089,25 @@ void draw_contour_strokes(ImagineXr_or_NFmiImage &img,
   begin = theSpec.contourValues().begin();
   end = theSpec.contourValues().end();
 
+  ContourCalculator::Values values;
   for (it = begin; it != end; ++it)
+    values.push_back(it->value());
+
+  vector<NFmiPath> paths = ctx.calculator.contour(
+      *ctx.queryinfo, values, theTime, theInterpolation, theArea, 10);
+  const ContourCalculator::CacheStates states = ctx.calculator.cacheStates();
+
+  vector<NFmiPath>::iterator pathiter = paths.begin();
+  ContourCalculator::CacheStates::const_iterator stateiter = states.begin();
+  for (it = begin; it != end; ++it, ++pathiter, ++stateiter)
   {
-    NFmiPath path =
-        globals.calculator.contour(*globals.queryinfo, it->value(), theTime, theInterpolation);
+    NFmiPath &path = *pathiter;
 
-    if (globals.verbose && globals.calculator.wasCached())
+    if (globals.verbose && *stateiter != ContourCalculator::NotCached)
       cout << "Using cached " << it->value() << endl;
 
     NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
     // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
-    path.SimplifyLines(10);
     float width = it->linewidth();
     if (width == 1)
       path.Stroke(img, it->color(), rule);
@@ -4348,7 +5122,8 @@ void draw_contour_strokes(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void save_contour_labels(ImagineXr_or_NFmiImage &img,
+void save_contour_labels(RenderContext &ctx,
+                         ImagineXr_or_NFmiImage &img,
                          const NFmiArea &theArea,
                          const ContourSpec &theSpec,
                          const NFmiTime &theTime,
@@ -4357,7 +5132,7 @@ void save_contour_labels(ImagineXr_or_NFmiImage &img,
   // The ID under which the coordinates will be stored
 
   int id = paramid(theSpec.param());
-  globals.labellocator.parameter(id);
+  ctx.labellocator.parameter(id);
 
   // Start saving candindate coordinates
 
@@ -4368,20 +5143,26 @@ void save_contour_labels(ImagineXr_or_NFmiImage &img,
   begin = theSpec.contourLabels().begin();
   end = theSpec.contourLabels().end();
 
+  ContourCalculator::Values values;
   for (it = begin; it != end; ++it)
+    values.push_back(it->value());
+
+  vector<NFmiPath> paths =
+      ctx.calculator.contour(*ctx.queryinfo, values, theTime, theInterpolation, theArea);
+
+  vector<NFmiPath>::iterator pathiter = paths.begin();
+  for (it = begin; it != end; ++it, ++pathiter)
   {
-    NFmiPath path =
-        globals.calculator.contour(*globals.queryinfo, it->value(), theTime, theInterpolation);
+    const NFmiPath &path = *pathiter;
 
     // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
 
     for (NFmiPathData::const_iterator pit = path.Elements().begin(); pit != path.Elements().end();
          ++pit)
     {
       if (pit->op == kFmiLineTo)
       {
-        globals.labellocator.add(
+        ctx.labellocator.add(
             it->value(), static_cast<int>(round(pit->x)), static_cast<int>(round(pit->y)));
       }
     }
@@ -4394,9 +5175,9 @@ void save_contour_labels(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_labels(ImagineXr_or_NFmiImage &img)
+void draw_contour_labels(RenderContext &ctx, ImagineXr_or_NFmiImage &img)
 {
-  const LabelLocator::ParamCoordinates &coords = globals.labellocator.chooseLabels();
+  const LabelLocator::ParamCoordinates &coords = ctx.labellocator.chooseLabels();
 
   if (coords.empty())
     return;
@@ -4404,8 +5185,8 @@ void draw_contour_labels(ImagineXr_or_NFmiImage &img)
   // Iterate through all parameters
 
   list<ContourSpec>::iterator piter;
-  list<ContourSpec>::iterator pbegin = globals.specs.begin();
-  list<ContourSpec>::iterator pend = globals.specs.end();
+  list<ContourSpec>::iterator pbegin = ctx.specs.begin();
+  list<ContourSpec>::iterator pend = ctx.specs.end();
 
   for (piter = pbegin; piter != pend; ++piter)
   {
@@ -4470,7 +5251,8 @@ void draw_contour_labels(ImagineXr_or_NFmiImage &img)
  */
 // ----------------------------------------------------------------------
 
-void save_contour_symbols(ImagineXr_or_NFmiImage &img,
+void save_contour_symbols(RenderContext &ctx,
+                          ImagineXr_or_NFmiImage &img,
                           const NFmiArea &theArea,
                           const ContourSpec &theSpec,
                           const LazyCoordinates &thePoints,
@@ -4479,7 +5261,7 @@ void save_contour_symbols(ImagineXr_or_NFmiImage &img,
   // The ID under which the coordinates will be stored
 
   int id = paramid(theSpec.param());
-  globals.imagelocator.parameter(id);
+  ctx.imagelocator.parameter(id);
 
   list<ContourSymbol>::const_iterator it;
   list<ContourSymbol>::const_iterator begin;
@@ -4515,7 +5297,7 @@ void save_contour_symbols(ImagineXr_or_NFmiImage &img,
           // latlon = MeridianTools::Relocate(latlon,theArea);
           NFmiPoint xy = theArea.ToXY(latlon);
 
-          globals.imagelocator.add(
+          ctx.imagelocator.add(
               z, static_cast<int>(round(xy.X())), static_cast<int>(round(xy.Y())));
         }
       }
@@ -4528,9 +5310,9 @@ void save_contour_symbols(ImagineXr_or_NFmiImage &img,
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_symbols(ImagineXr_or_NFmiImage &img)
+void draw_contour_symbols(RenderContext &ctx, ImagineXr_or_NFmiImage &img)
 {
-  const LabelLocator::ParamCoordinates &paramcoords = globals.imagelocator.chooseLabels();
+  const LabelLocator::ParamCoordinates &paramcoords = ctx.imagelocator.chooseLabels();
 
   if (paramcoords.empty())
     return;
@@ -4538,8 +5320,8 @@ void draw_contour_symbols(ImagineXr_or_NFmiImage &img)
   // Iterate through all parameters
 
   list<ContourSpec>::iterator piter;
-  list<ContourSpec>::iterator pbegin = globals.specs.begin();
-  list<ContourSpec>::iterator pend = globals.specs.end();
+  list<ContourSpec>::iterator pbegin = ctx.specs.begin();
+  list<ContourSpec>::iterator pend = ctx.specs.end();
 
   for (piter = pbegin; piter != pend; ++piter)
   {
@@ -4608,9 +5390,9 @@ void draw_contour_symbols(ImagineXr_or_NFmiImage &img)
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_fonts(ImagineXr_or_NFmiImage &img)
+void draw_contour_fonts(RenderContext &ctx, ImagineXr_or_NFmiImage &img)
 {
-  const LabelLocator::ParamCoordinates &paramcoords = globals.symbollocator.chooseLabels();
+  const LabelLocator::ParamCoordinates &paramcoords = ctx.symbollocator.chooseLabels();
 
   if (paramcoords.empty())
     return;
@@ -4618,8 +5400,8 @@ void draw_contour_fonts(ImagineXr_or_NFmiImage &img)
   // Iterate through all parameters
 
   list<ContourSpec>::iterator piter;
-  list<ContourSpec>::iterator pbegin = globals.specs.begin();
-  list<ContourSpec>::iterator pend = globals.specs.end();
+  list<ContourSpec>::iterator pbegin = ctx.specs.begin();
+  list<ContourSpec>::iterator pend = ctx.specs.end();
 
   for (piter = pbegin; piter != pend; ++piter)
   {
@@ -4693,7 +5475,8 @@ void draw_contour_fonts(ImagineXr_or_NFmiImage &img)
  */
 // ----------------------------------------------------------------------
 
-void save_contour_fonts(ImagineXr_or_NFmiImage &img,
+void save_contour_fonts(RenderContext &ctx,
+                        ImagineXr_or_NFmiImage &img,
                         const NFmiArea &theArea,
                         const ContourSpec &theSpec,
                         const LazyCoordinates &thePoints,
@@ -4702,7 +5485,7 @@ void save_contour_fonts(ImagineXr_or_NFmiImage &img,
   // The ID under which the coordinates will be stored
 
   int id = paramid(theSpec.param());
-  globals.symbollocator.parameter(id);
+  ctx.symbollocator.parameter(id);
 
   // For speed we prefer to iterate only once through the data, and
   // instead use a fast way to test if a given value is to be contoured
@@ -4732,7 +5515,7 @@ void save_contour_fonts(ImagineXr_or_NFmiImage &img,
         // latlon = MeridianTools::Relocate(latlon,theArea);
         NFmiPoint xy = theArea.ToXY(latlon);
 
-        globals.symbollocator.add(
+        ctx.symbollocator.add(
             theValues[i][j], static_cast<int>(round(xy.X())), static_cast<int>(round(xy.Y())));
       }
     }
@@ -4839,7 +5622,9 @@ int extrematype(
  */
 // ----------------------------------------------------------------------
 
-void draw_pressure_markers(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
+void draw_pressure_markers(RenderContext &ctx,
+                           ImagineXr_or_NFmiImage &img,
+                           const NFmiArea &theArea)
 {
   // Establish which markers are to be drawn
 
@@ -4853,12 +5638,12 @@ void draw_pressure_markers(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
 
   // Get the data to be analyzed
 
-  choose_queryinfo("Pressure", 0);
+  choose_queryinfo(ctx, "Pressure", 0);
 
-  auto worldpts = globals.queryinfo->LocationsWorldXY(theArea);
+  auto worldpts = ctx.queryinfo->LocationsWorldXY(theArea);
 
-  auto vals = globals.queryinfo->Values();
-  globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), vals);
+  auto vals = ctx.queryinfo->Values();
+  globals.unitsconverter.convert(FmiParameterName(ctx.queryinfo->GetParamIdent()), vals);
 
   // Insert candidate coordinates into the system
 
@@ -4881,19 +5666,19 @@ void draw_pressure_markers(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
         if (extrem < 0)
         {
           if (dolow)
-            globals.pressurelocator.add(ExtremaLocator::Minimum, point.X(), point.Y());
+            ctx.pressurelocator.add(ExtremaLocator::Minimum, point.X(), point.Y());
         }
         else
         {
           if (dohigh)
-            globals.pressurelocator.add(ExtremaLocator::Maximum, point.X(), point.Y());
+            ctx.pressurelocator.add(ExtremaLocator::Maximum, point.X(), point.Y());
         }
       }
     }
 
   // Now choose the marker positions and draw them
 
-  const ExtremaLocator::ExtremaCoordinates &extrema = globals.pressurelocator.chooseCoordinates();
+  const ExtremaLocator::ExtremaCoordinates &extrema = ctx.pressurelocator.chooseCoordinates();
 
   NFmiColorTools::NFmiBlendRule lowrule = ColorTools::checkrule(globals.lowpressurerule);
   NFmiColorTools::NFmiBlendRule highrule = ColorTools::checkrule(globals.highpressurerule);
@@ -4952,113 +5737,821 @@ void draw_foreground(ImagineXr_or_NFmiImage &img)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Handle "draw contours" command
+ * \brief An image to be rendered by "draw contours"
  */
 // ----------------------------------------------------------------------
 
-void do_draw_contours(istream &theInput)
+struct RenderTime
 {
-  // 1. Make sure query data has been read
-  // 2. Make sure image has been initialized
-  // 3. Loop over all times
-  //   4. If the time is acceptable,
-  //   5. Loop over all parameters
-  //     6. Fill all specified intervals
-  //     7. Patternfill all specified intervals
-  //     8. Stroke all specified contours
-  //   9. Overwrite with foreground if so desired
-  //   10. Loop over all parameters
-  //     11. Label all specified points
-  //   12. Draw arrows if requested
-  //   13. Save the image
-
-  globals.labellocator.clear();
-  globals.pressurelocator.clear();
-  globals.symbollocator.clear();
-  globals.imagelocator.clear();
-
-  if (globals.querystreams.empty())
-    throw runtime_error("No query data has been read!");
-
-  auto area = globals.createArea();
-
-  // This message intentionally ignores globals.verbose
-
-  if (!globals.background.empty())
-    cout << "Contouring for background " << globals.background << endl;
+  NFmiTime time;
+  std::string timestamp;
+  std::string filename;
+  bool skip;  // image exists and is not overwritten
+};
 
-  if (globals.verbose)
-    report_area(*area);
-
-  // Establish querydata timelimits and initialize
-  // the XY-coordinates simultaneously.
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create a new image initialized to the background
+ */
+// ----------------------------------------------------------------------
 
-  // Note that we use world-coordinates when smoothing
-  // so that we can use meters as the smoothing radius.
-  // Also, this means the contours are independent of
-  // the image size.
+std::shared_ptr<ImagineXr_or_NFmiImage> create_image(const NFmiArea &theArea,
+                                                    const string &theFilename)
+{
+  int imgwidth = static_cast<int>(theArea.Width() + 0.5);
+  int imgheight = static_cast<int>(theArea.Height() + 0.5);
 
-  NFmiTime time1, time2;
+  NFmiColorTools::Color erasecolor = ColorTools::checkcolor(globals.erase);
 
-  NFmiDataMatrix<float> vals;
-  NFmiDataMatrix<float> maskvalues;
+#ifdef IMAGINE_WITH_CAIRO
+  std::shared_ptr<ImagineXr> xr(new ImagineXr(imgwidth, imgheight, theFilename, globals.format));
 
-  unsigned int qi;
-  for (qi = 0; qi < globals.querystreams.size(); qi++)
+  if (globals.background.empty())
   {
-    // Establish time limits
+    xr->Erase(erasecolor);
+  }
+  else
+  {
+    const ImagineXr &xr2 = globals.getImage(globals.background);
 
-    globals.queryinfo = globals.querystreams[qi];
+    if ((xr2.Width() != xr->Width()) || (xr2.Height() != xr->Height()))
+      throw runtime_error("Background image size does not match area size");
 
-    globals.queryinfo->LastTime();
-    NFmiTime t2 = globals.queryinfo->ValidTime();
+    xr->Composite(xr2);
+  }
+  return xr;
+#else
+  // Recycle the images of the previous timesteps
 
-    globals.queryinfo->FirstTime();
-    NFmiTime t1 = globals.queryinfo->ValidTime();
+  std::shared_ptr<Imagine::NFmiImage> image = globals.imagepool.get(imgwidth, imgheight);
+  if (image.get() == 0)
+    throw runtime_error("Failed to allocate a new image for rendering");
 
-    if (qi == 0)
-    {
-      time1 = t1;
-      time2 = t2;
-    }
-    else
+  if (globals.background.empty())
+  {
+    image->Erase(erasecolor);
+  }
+  else
+  {
+    const Imagine::NFmiImage &background = globals.getImage(globals.background);
+    if (imgwidth != background.Width() || imgheight != background.Height())
     {
-      if (time1.IsLessThan(t1))
-        time1 = t1;
-      if (!time2.IsLessThan(t2))
-        time2 = t2;
+      throw runtime_error("Background image size does not match area size");
     }
-  }
 
-  if (globals.verbose)
-  {
-    cout << "Data start time " << time1 << endl << "Data end time " << time2 << endl;
-  }
+    // Copy the pixels into the storage of the pooled image, the sizes are equal
 
-  // Skip to first time
+    for (int j = 0; j < imgheight; j++)
+      for (int i = 0; i < imgwidth; i++)
+        (*image)(i, j) = background(i, j);
+  }
 
-  NFmiMetTime tmptime(time1,
-                      globals.timesteprounding ? (globals.timestep > 0 ? globals.timestep : 1) : 1);
+  globals.setImageModes(*image);
+  return image;
+#endif
+}
 
-  tmptime.ChangeByMinutes(globals.timestepskip);
-  if (globals.timesteprounding)
-    tmptime.PreviousMetTime();
-  NFmiTime t = tmptime;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Initialize the bounding boxes of the label locators
+ */
+// ----------------------------------------------------------------------
 
-  // Loop over all times
+void set_locator_boxes(RenderContext &ctx, const ImagineXr_or_NFmiImage &img)
+{
+  // Initialize label locator bounding box
 
-  int imagesdone = 0;
-  bool labeldxdydone = false;
-  for (;;)
-  {
-    if (imagesdone >= globals.timesteps)
-      break;
+  ctx.labellocator.boundingBox(globals.contourlabelimagexmargin,
+                               globals.contourlabelimageymargin,
+                               img.Width() - globals.contourlabelimagexmargin,
+                               img.Height() - globals.contourlabelimageymargin);
 
-    // Skip to next time to be drawn
+  // Initialize symbol locator bounding box with reasonably safety
+  // for large symbols
 
-    t.ChangeByMinutes(globals.timestep > 0 ? globals.timestep : 1);
+  ctx.symbollocator.boundingBox(-30, -30, img.Width() + 30, img.Height() + 30);
+  ctx.imagelocator.boundingBox(-30, -30, img.Width() + 30, img.Height() + 30);
+}
 
-    // If the time is after time2, we're done
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render the contours of all parameters
+ *
+ * The contour label, symbol and font candidates are collected into
+ * the locators of the context, but are not rendered yet.
+ *
+ * \param ctx The render context
+ * \param img The image to render into
+ * \param theArea The area being rendered
+ * \param theTime The time being rendered
+ * \param theGridLabelsDone True if the grid label points have already been added
+ * \param thePrefetchedValues The prefetched values of each parameter, or empty
+ */
+// ----------------------------------------------------------------------
+
+void render_contours(RenderContext &ctx,
+                     ImagineXr_or_NFmiImage &img,
+                     const NFmiArea &theArea,
+                     const NFmiTime &theTime,
+                     bool theGridLabelsDone,
+                     vector<NFmiDataMatrix<float>> &thePrefetchedValues)
+{
+  NFmiDataMatrix<float> vals;
+
+  // Loop over all parameters
+  // The loop collects all contour label information, but
+  // does not render it yet
+
+  list<ContourSpec>::iterator piter;
+  list<ContourSpec>::iterator pbegin = ctx.specs.begin();
+  list<ContourSpec>::iterator pend = ctx.specs.end();
+
+  for (piter = pbegin; piter != pend; ++piter)
+  {
+    // Establish the parameter
+
+    string name = piter->param();
+    int level = piter->level();
+
+    unsigned int qi = choose_queryinfo(ctx, name, level);
+
+    if (globals.verbose)
+      report_queryinfo(name, qi);
+
+    // Establish the contour method
+
+    string interpname = piter->contourInterpolation();
+    ContourInterpolation interp = ContourInterpolationValue(interpname);
+    if (interp == Missing)
+      throw runtime_error("Unknown contour interpolation method " + interpname);
+
+    // Get the values, unless they have already been prefetched
+
+    if (thePrefetchedValues.empty())
+      extract_values(*ctx.queryinfo, vals, theTime, *piter, theArea);
+    else
+      vals = std::move(thePrefetchedValues[std::distance(pbegin, piter)]);
+
+    LazyCoordinates worldpts(theArea, *ctx.queryinfo);
+
+    // Setup the contourer with the values
+
+    ctx.calculator.data(vals);
+
+    if (globals.contourviewport)
+      set_contour_window(ctx.calculator, theArea, worldpts, vals);
+
+    // Save the data values at desired points for later
+    // use, this lets us avoid using InterpolatedValue()
+    // which does not use smoothened values.
+
+    // First, however, if this is the first image, we add
+    // the grid points to the set of points, if so requested
+
+    if (!theGridLabelsDone)
+      add_label_grid_values(*piter, theArea, worldpts);
+
+    // For pixelgrids we must repeat the process for all new
+    // background images, since the pixel spacing changes
+    // every time. Note! We assume the following calling order!
+
+    add_label_point_values(ctx, *piter, theArea, vals);
+    add_label_pixelgrid_values(ctx, *piter, theArea, img, vals);
+
+    // Fill the contours
+
+    draw_contour_fills(ctx, img, theArea, *piter, theTime, interp);
+
+    // Pattern fill the contours
+
+    draw_contour_patterns(ctx, img, theArea, *piter, theTime, interp);
+
+    // Stroke the contours
+
+    draw_contour_strokes(ctx, img, theArea, *piter, theTime, interp);
+
+    // Save contour symbol coordinates
+
+    save_contour_symbols(ctx, img, theArea, *piter, worldpts, vals);
+
+    // Save symbol fill coordinates
+
+    save_contour_fonts(ctx, img, theArea, *piter, worldpts, vals);
+
+    // Save contour label coordinates
+
+    save_contour_labels(ctx, img, theArea, *piter, theTime, interp);
+
+    // Draw optional overlay
+
+    draw_overlay(img, *piter);
+  }
+
+  // Draw graticule
+
+  draw_graticule(img, theArea);
+
+  // Bang the foreground
+
+  draw_foreground(img);
+
+  // Draw wind arrows if so requested
+
+  draw_wind_arrows(ctx, img, theArea);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render the labels, symbols and markers
+ *
+ * The labels are chosen from the candidates collected into the
+ * locators of the context by render_contours.
+ */
+// ----------------------------------------------------------------------
+
+void render_labels(RenderContext &ctx,
+                   ImagineXr_or_NFmiImage &img,
+                   const NFmiArea &theArea,
+                   const NFmiTime &theTime)
+{
+  // Draw contour symbols
+
+  draw_contour_symbols(ctx, img);
+
+  // Draw contour fonts
+
+  draw_contour_fonts(ctx, img);
+
+  // Label the contours
+
+  draw_contour_labels(ctx, img);
+
+  // Draw labels
+
+  for (list<ContourSpec>::const_iterator piter = ctx.specs.begin(); piter != ctx.specs.end();
+       ++piter)
+  {
+    draw_label_markers(img, *piter, theArea);
+    draw_label_texts(img, *piter, theArea);
+  }
+
+  // Draw high/low pressure markers
+
+  draw_pressure_markers(ctx, img, theArea);
+
+  // Bang the combine image (legend, logo, whatever)
+
+  globals.drawCombine(img);
+
+  // Finally, draw a time stamp on the image if so
+  // requested
+
+  const string stamp = globals.getImageStampText(theTime);
+  globals.drawImageStampText(img, stamp);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Save a rendered image
+ *
+ * The image is handed over to the image writer, and may hence
+ * be written only later on.
+ */
+// ----------------------------------------------------------------------
+
+void save_image(const std::shared_ptr<ImagineXr_or_NFmiImage> &theImage,
+                const string &theFilename)
+{
+#ifdef IMAGINE_WITH_CAIRO
+  assert(theImage->Filename() != "");
+  std::shared_ptr<ColorPalette> palette = globals.palette;
+  globals.imagewriter.write(theFilename,
+                            [theImage, palette]() { write_image(*theImage, palette.get()); });
+#else
+  const string format = globals.format;
+  std::shared_ptr<ColorPalette> palette = globals.palette;
+  globals.imagewriter.write(theFilename,
+                            [theImage, theFilename, format, palette]()
+                            { write_image(*theImage, theFilename, format, palette.get()); });
+#endif
+
+  if (!globals.itsImageCacheOn)
+    globals.itsImageCache.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Advance the label locators to the next image
+ */
+// ----------------------------------------------------------------------
+
+void next_time(RenderContext &ctx)
+{
+  ctx.labellocator.nextTime();
+  ctx.pressurelocator.nextTime();
+  ctx.symbollocator.nextTime();
+  ctx.imagelocator.nextTime();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The private state of a thread rendering images in parallel
+ */
+// ----------------------------------------------------------------------
+
+struct RenderState
+{
+  std::shared_ptr<NFmiArea> area;
+  std::vector<std::shared_ptr<LazyQueryData>> querystreams;
+  Globals::StreamIndex querystreamindex;
+  std::shared_ptr<LazyQueryData> queryinfo;
+  std::shared_ptr<ContourCalculator> calculator;
+  std::list<ContourSpec> specs;
+  LabelLocator labellocator;   // records the label candidates
+  LabelLocator symbollocator;  // records the font candidates
+  LabelLocator imagelocator;   // records the symbol candidates
+  bool labeldxdydone;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render the images using several threads
+ *
+ * Each thread renders the contours using its own clones of the data,
+ * its own contourer and its own copy of the contour specifications.
+ * The label candidates are only recorded at first, since the labels
+ * are chosen based on the labels of the previous image. Once the
+ * labels of the previous image have been chosen, the recorded
+ * candidates are handed over to the global locators and the labels
+ * are rendered. The images are hence identical to the ones rendered
+ * sequentially, only the verbose output of the threads may be mixed.
+ *
+ * \param theTimes The images to be rendered, in order
+ */
+// ----------------------------------------------------------------------
+
+void render_parallel(const vector<RenderTime> &theTimes)
+{
+  const std::size_t nthreads = std::min<std::size_t>(globals.imagethreads, theTimes.size());
+
+  // The contourers are kept for later commands to reuse the cached contours
+
+  while (globals.imagecalculators.size() < nthreads)
+    globals.imagecalculators.push_back(std::make_shared<ContourCalculator>());
+
+  std::size_t evictions = 0;
+  for (std::size_t i = 0; i < globals.imagecalculators.size(); i++)
+    evictions += globals.imagecalculators[i]->cacheEvictions();
+
+  vector<std::unique_ptr<RenderState>> states;
+  vector<RenderState *> idle;
+
+  for (std::size_t i = 0; i < nthreads; i++)
+  {
+    std::unique_ptr<RenderState> state(new RenderState);
+    state->area = globals.createArea();
+    for (unsigned int qi = 0; qi < globals.querystreams.size(); qi++)
+      state->querystreams.push_back(globals.querystreams[qi]->Clone());
+    state->querystreamindex = globals.querystreamindex;
+    state->calculator = globals.imagecalculators[i];
+    state->calculator->settings(globals.calculator);
+    state->specs = globals.specs;
+    state->labeldxdydone = false;
+    idle.push_back(state.get());
+    states.push_back(std::move(state));
+  }
+
+  // The labels are handled one image at a time in the original order
+
+  std::mutex mutex;
+  std::condition_variable turnchanged;
+  std::size_t turn = 0;
+  bool aborted = false;
+  RenderState *laststate = 0;
+
+  auto wait_turn = [&](std::size_t k)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    turnchanged.wait(lock, [&] { return turn == k || aborted; });
+    return !aborted;
+  };
+
+  auto pass_turn = [&]()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++turn;
+    turnchanged.notify_all();
+  };
+
+  auto task = [&](std::size_t k)
+  {
+    const RenderTime &item = theTimes[k];
+
+    if (item.skip)
+    {
+      if (!wait_turn(k))
+        return;
+      if (globals.verbose)
+        cout << "Time is " << item.timestamp << endl
+             << "Not overwriting " << item.filename << endl;
+      pass_turn();
+      return;
+    }
+
+    RenderState *state;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (aborted)
+        return;
+      state = idle.back();
+      idle.pop_back();
+    }
+
+    // Return the state to the idle ones whichever way the task ends
+
+    struct StateGuard
+    {
+      std::mutex &mutex;
+      vector<RenderState *> &idle;
+      RenderState *state;
+      ~StateGuard()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(state);
+      }
+    } guard = {mutex, idle, state};
+
+    try
+    {
+      // The pressure locator is not used before the labels are handed over
+
+      RenderContext context = {state->querystreams,
+                               state->querystreamindex,
+                               state->queryinfo,
+                               *state->calculator,
+                               state->specs,
+                               state->labellocator,
+                               state->symbollocator,
+                               state->imagelocator,
+                               globals.pressurelocator};
+
+      for (unsigned int qi = 0; qi < state->querystreams.size(); qi++)
+        state->querystreams[qi]->SetTimeAtOrAfter(item.time);
+
+      std::shared_ptr<ImagineXr_or_NFmiImage> image = create_image(*state->area, item.filename);
+
+      state->labellocator.record(true);
+      state->symbollocator.record(true);
+      state->imagelocator.record(true);
+      set_locator_boxes(context, *image);
+
+      vector<NFmiDataMatrix<float>> prefetchedvalues;
+      render_contours(
+          context, *image, *state->area, item.time, state->labeldxdydone, prefetchedvalues);
+      state->labeldxdydone = true;
+
+      if (!wait_turn(k))
+        return;
+
+      // Choose and render the labels based on the previous image
+
+      if (globals.verbose)
+        cout << "Time is " << item.timestamp << endl;
+
+      RenderContext handoff = {state->querystreams,
+                               state->querystreamindex,
+                               state->queryinfo,
+                               *state->calculator,
+                               state->specs,
+                               globals.labellocator,
+                               globals.symbollocator,
+                               globals.imagelocator,
+                               globals.pressurelocator};
+
+      set_locator_boxes(handoff, *image);
+      globals.labellocator.replay(state->labellocator);
+      globals.symbollocator.replay(state->symbollocator);
+      globals.imagelocator.replay(state->imagelocator);
+
+      render_labels(handoff, *image, *state->area, item.time);
+
+      next_time(handoff);
+      laststate = state;
+      pass_turn();
+
+      save_image(image, item.filename);
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      aborted = true;
+      turnchanged.notify_all();
+      throw;
+    }
+  };
+
+  // Images may be needed by several threads, hence the cache is
+  // not cleared until all images have been rendered
+
+  const bool imagecacheon = globals.itsImageCacheOn;
+  globals.itsImageCacheOn = true;
+
+  try
+  {
+    ParallelTools::run(theTimes.size(), nthreads, task);
+  }
+  catch (...)
+  {
+    globals.itsImageCacheOn = imagecacheon;
+    if (!imagecacheon)
+      globals.itsImageCache.clear();
+    throw;
+  }
+
+  globals.itsImageCacheOn = imagecacheon;
+  if (!imagecacheon)
+    globals.itsImageCache.clear();
+
+  // Report the evictions of all the contourers at once
+
+  if (globals.verbose)
+  {
+    std::size_t newevictions = 0;
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < globals.imagecalculators.size(); i++)
+    {
+      newevictions += globals.imagecalculators[i]->cacheEvictions();
+      bytes += globals.imagecalculators[i]->cacheBytes();
+    }
+    if (newevictions != evictions)
+      cout << "Evicted " << newevictions - evictions << " contours from the cache, " << bytes
+           << " bytes remain cached" << endl;
+  }
+
+  // Keep the label values of the last image just like sequential rendering
+
+  if (laststate != 0)
+    globals.specs = laststate->specs;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the colors of an image to a palette
+ */
+// ----------------------------------------------------------------------
+
+void add_image_colors(ColorPalette &thePalette, const string &theFile)
+{
+  if (theFile.empty())
+    return;
+
+  const ImagineXr_or_NFmiImage &img = globals.getImage(theFile);
+
+#ifdef IMAGINE_WITH_CAIRO
+  vector<NFmiColorTools::Color> pixels(img.Width() * img.Height());
+  img.NFmiColorBuf(&pixels[0]);
+  thePalette.add(&pixels[0], pixels.size());
+#else
+  for (int j = 0; j < img.Height() && thePalette.usable(); j++)
+    for (int i = 0; i < img.Width(); i++)
+      thePalette.add(img(i, j));
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect the colors known to be used in the images
+ *
+ * The palette consists of the colors of the contours, labels and
+ * arrows plus the colors of all the images composited into the
+ * rendered images.
+ *
+ * \return The palette, or empty if it has too many colors
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<ColorPalette> make_palette()
+{
+  std::shared_ptr<ColorPalette> palette(new ColorPalette);
+
+  palette->add(ColorTools::checkcolor(globals.erase));
+  if (!globals.graticulecolor.empty())
+    palette->add(ColorTools::checkcolor(globals.graticulecolor));
+
+  palette->add(globals.timestampimagecolor);
+  palette->add(globals.timestampimagebackground);
+
+  palette->add(ColorTools::parsecolor(globals.arrowfillcolor));
+  palette->add(ColorTools::parsecolor(globals.arrowstrokecolor));
+
+  for (const ArrowStyle &style : globals.arrowfillstyles)
+    palette->add(style.color);
+  for (const ArrowStyle &style : globals.arrowstrokestyles)
+    palette->add(style.color);
+
+  for (const RoundArrowColor &color : globals.roundarrowfillcolors)
+  {
+    palette->add(color.circlecolor);
+    palette->add(color.trianglecolor);
+  }
+  for (const RoundArrowColor &color : globals.roundarrowstrokecolors)
+  {
+    palette->add(color.circlecolor);
+    palette->add(color.trianglecolor);
+  }
+
+  for (const ContourSpec &spec : globals.specs)
+  {
+    palette->add(spec.labelColor());
+    palette->add(spec.contourLabelColor());
+    palette->add(spec.contourLabelBackgroundColor());
+
+    for (const ContourRange &range : spec.contourFills())
+      palette->add(range.color());
+    for (const ContourValue &value : spec.contourValues())
+      palette->add(value.color());
+    for (const ContourFont &font : spec.contourFonts())
+      palette->add(font.color());
+
+    for (const ContourPattern &pattern : spec.contourPatterns())
+      add_image_colors(*palette, pattern.pattern());
+    for (const ContourSymbol &symbol : spec.contourSymbols())
+      add_image_colors(*palette, symbol.pattern());
+
+    add_image_colors(*palette, spec.overlay());
+    add_image_colors(*palette, spec.labelMarker());
+  }
+
+  add_image_colors(*palette, globals.background);
+  add_image_colors(*palette, globals.foreground);
+  add_image_colors(*palette, globals.combine);
+
+  if (globals.verbose)
+  {
+    if (palette->usable())
+      cout << "Known palette has " << palette->size() << " colors" << endl;
+    else
+      cout << "Known palette has too many colors, quantizing colors instead" << endl;
+  }
+
+  if (!palette->usable())
+    palette.reset();
+
+  return palette;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of contours not written into the disk cache
+ *
+ * The errors are summed over all the contourers.
+ */
+// ----------------------------------------------------------------------
+
+std::size_t cache_write_errors()
+{
+  std::size_t errors = globals.calculator.cacheWriteErrors();
+  errors += globals.maskcalculator.cacheWriteErrors();
+  for (std::size_t i = 0; i < globals.imagecalculators.size(); i++)
+    errors += globals.imagecalculators[i]->cacheWriteErrors();
+  return errors;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Warn about failed writes into the disk cache
+ *
+ * The disk cache is optional, hence failing to write into it
+ * only produces a warning in verbose mode.
+ *
+ * \param theErrors The number of errors before rendering
+ */
+// ----------------------------------------------------------------------
+
+void report_cache_write_errors(std::size_t theErrors)
+{
+  const std::size_t errors = cache_write_errors();
+  if (globals.verbose && errors != theErrors)
+    cout << "Warning: Failed to write " << errors - theErrors
+         << " contours into the contour cache directory" << endl;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "draw contours" command
+ */
+// ----------------------------------------------------------------------
+
+void do_draw_contours(istream &theInput)
+{
+  // 1. Make sure query data has been read
+  // 2. Make sure image has been initialized
+  // 3. Loop over all times
+  //   4. If the time is acceptable,
+  //   5. Loop over all parameters
+  //     6. Fill all specified intervals
+  //     7. Patternfill all specified intervals
+  //     8. Stroke all specified contours
+  //   9. Overwrite with foreground if so desired
+  //   10. Loop over all parameters
+  //     11. Label all specified points
+  //   12. Draw arrows if requested
+  //   13. Save the image
+
+  globals.labellocator.clear();
+  globals.pressurelocator.clear();
+  globals.symbollocator.clear();
+  globals.imagelocator.clear();
+
+  if (globals.querystreams.empty())
+    throw runtime_error("No query data has been read!");
+
+  auto area = globals.createArea();
+
+  // The images being written keep their own palettes
+
+  globals.palette.reset();
+  if (globals.reducecolors && globals.knownpalette)
+    globals.palette = make_palette();
+
+  // This message intentionally ignores globals.verbose
+
+  if (!globals.background.empty())
+    cout << "Contouring for background " << globals.background << endl;
+
+  if (globals.verbose)
+    report_area(*area);
+
+  // Establish querydata timelimits and initialize
+  // the XY-coordinates simultaneously.
+
+  // Note that we use world-coordinates when smoothing
+  // so that we can use meters as the smoothing radius.
+  // Also, this means the contours are independent of
+  // the image size.
+
+  NFmiTime time1, time2;
+
+  NFmiDataMatrix<float> maskvalues;
+
+  unsigned int qi;
+  for (qi = 0; qi < globals.querystreams.size(); qi++)
+  {
+    // Establish time limits
+
+    globals.queryinfo = globals.querystreams[qi];
+
+    globals.queryinfo->LastTime();
+    NFmiTime t2 = globals.queryinfo->ValidTime();
+
+    globals.queryinfo->FirstTime();
+    NFmiTime t1 = globals.queryinfo->ValidTime();
+
+    if (qi == 0)
+    {
+      time1 = t1;
+      time2 = t2;
+    }
+    else
+    {
+      if (time1.IsLessThan(t1))
+        time1 = t1;
+      if (!time2.IsLessThan(t2))
+        time2 = t2;
+    }
+  }
+
+  if (globals.verbose)
+  {
+    cout << "Data start time " << time1 << endl << "Data end time " << time2 << endl;
+  }
+
+  // Skip to first time
+
+  NFmiMetTime tmptime(time1,
+                      globals.timesteprounding ? (globals.timestep > 0 ? globals.timestep : 1) : 1);
+
+  tmptime.ChangeByMinutes(globals.timestepskip);
+  if (globals.timesteprounding)
+    tmptime.PreviousMetTime();
+  NFmiTime t = tmptime;
+
+  // Establish the times to be drawn first so that the
+  // values of the next image can be prefetched
+
+  vector<RenderTime> times;
+
+  int imagesdone = 0;
+  for (;;)
+  {
+    if (imagesdone >= globals.timesteps)
+      break;
+
+    // Skip to next time to be drawn
+
+    t.ChangeByMinutes(globals.timestep > 0 ? globals.timestep : 1);
+
+    // If the time is after time2, we're done
 
     if (time2.IsLessThan(t))
       break;
@@ -5072,13 +6565,7 @@ void do_draw_contours(istream &theInput)
     for (qi = 0; ok && qi < globals.querystreams.size(); qi++)
     {
       globals.queryinfo = globals.querystreams[qi];
-      globals.queryinfo->ResetTime();
-      while (globals.queryinfo->NextTime())
-      {
-        NFmiTime loc = globals.queryinfo->ValidTime();
-        if (!loc.IsLessThan(t))
-          break;
-      }
+      globals.queryinfo->SetTimeAtOrAfter(t);
       NFmiTime tnow = globals.queryinfo->ValidTime();
 
       // we wanted
@@ -5145,9 +6632,6 @@ void do_draw_contours(istream &theInput)
 
     NFmiString datatimestr = t.ToStr(globals.timestampformat);
 
-    if (globals.verbose)
-      cout << "Time is " << datatimestr.CharPtr() << endl;
-
     string filename = globals.savepath + "/" + globals.prefix + datatimestr.CharPtr();
 
     if (globals.timestampflag)
@@ -5167,227 +6651,99 @@ void do_draw_contours(istream &theInput)
     // exists. If so, we assume it is up to date
     // and skip to the next time stamp.
 
-    if (!globals.force && !NFmiFileSystem::FileEmpty(filename))
-    {
-      if (globals.verbose)
-        cout << "Not overwriting " << filename << endl;
-      continue;
-    }
-
-    // Initialize the background
-
-    int imgwidth = static_cast<int>(area->Width() + 0.5);
-    int imgheight = static_cast<int>(area->Height() + 0.5);
+    RenderTime item;
+    item.time = t;
+    item.timestamp = datatimestr.CharPtr();
+    item.filename = filename;
+    item.skip = (!globals.force && (!NFmiFileSystem::FileEmpty(filename) ||
+                                    globals.imagewriter.pending(filename)));
+    times.push_back(item);
+  }
 
-    NFmiColorTools::Color erasecolor = ColorTools::checkcolor(globals.erase);
+  // Render the images in parallel if so requested
 
-#ifdef IMAGINE_WITH_CAIRO
-    ImagineXr *xr = new ImagineXr(imgwidth, imgheight, filename, globals.format);
+  const std::size_t cacheerrors = cache_write_errors();
 
-    if (globals.background.empty())
-    {
-      xr->Erase(erasecolor);
-    }
-    else
-    {
-      const ImagineXr &xr2 = globals.getImage(globals.background);
-
-      if ((xr2.Width() != xr->Width()) || (xr2.Height() != xr->Height()))
-        throw runtime_error("Background image size does not match area size");
-
-      xr->Composite(xr2);
-    }
-#else
-    std::shared_ptr<Imagine::NFmiImage> image;
-    if (globals.background.empty())
-    {
-      image.reset(new Imagine::NFmiImage(imgwidth, imgheight, erasecolor));
-    }
-    else
-    {
-      image.reset(new Imagine::NFmiImage(globals.getImage(globals.background)));
-      if (imgwidth != image->Width() || imgheight != image->Height())
-      {
-        throw runtime_error("Background image size does not match area size");
-      }
-    }
-    if (image.get() == 0)
-      throw runtime_error("Failed to allocate a new image for rendering");
+  if (globals.imagethreads > 1)
+  {
+    render_parallel(times);
+    report_cache_write_errors(cacheerrors);
+    return;
+  }
 
-    globals.setImageModes(*image);
-#define xr image /* HACK */
-#endif
+  // The prefetching thread uses its own clones of the data, the
+  // specifications and the area, since rendering modifies them
 
-    // Initialize label locator bounding box
+  vector<std::shared_ptr<LazyQueryData>> clones;
+  if (globals.prefetch)
+    for (qi = 0; qi < globals.querystreams.size(); qi++)
+      clones.push_back(globals.querystreams[qi]->Clone());
 
-    globals.labellocator.boundingBox(globals.contourlabelimagexmargin,
-                                     globals.contourlabelimageymargin,
-                                     xr->Width() - globals.contourlabelimagexmargin,
-                                     xr->Height() - globals.contourlabelimageymargin);
+  Globals::StreamIndex cloneindex = globals.querystreamindex;
+  const list<ContourSpec> clonespecs = globals.specs;
+  std::shared_ptr<NFmiArea> clonearea = globals.createArea();
 
-    // Initialize symbol locator bounding box with reasonably safety
-    // for large symbols
+  std::future<vector<NFmiDataMatrix<float>>> prefetched;
+  std::size_t prefetchedindex = times.size();
 
-    globals.symbollocator.boundingBox(-30, -30, xr->Width() + 30, xr->Height() + 30);
-    globals.imagelocator.boundingBox(-30, -30, xr->Width() + 30, xr->Height() + 30);
+  // Loop over all times
 
-    // Loop over all parameters
-    // The loop collects all contour label information, but
-    // does not render it yet
+  RenderContext context = global_context();
+  bool labeldxdydone = false;
 
-    list<ContourSpec>::iterator piter;
-    list<ContourSpec>::iterator pbegin = globals.specs.begin();
-    list<ContourSpec>::iterator pend = globals.specs.end();
+  std::size_t evictions = globals.calculator.cacheEvictions();
+  for (std::size_t k = 0; k < times.size(); k++)
+  {
+    if (globals.verbose)
+      cout << "Time is " << times[k].timestamp << endl;
 
-    for (piter = pbegin; piter != pend; ++piter)
+    if (times[k].skip)
     {
-      // Establish the parameter
-
-      string name = piter->param();
-      int level = piter->level();
-
-      qi = choose_queryinfo(name, level);
-
       if (globals.verbose)
-        report_queryinfo(name, qi);
-
-      // Establish the contour method
-
-      string interpname = piter->contourInterpolation();
-      ContourInterpolation interp = ContourInterpolationValue(interpname);
-      if (interp == Missing)
-        throw runtime_error("Unknown contour interpolation method " + interpname);
-
-      // Get the values.
-
-      if (!MetaFunctions::isMeta(name))
-      {
-        vals = globals.queryinfo->Values();
-        globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), vals);
-      }
-      else
-        vals = MetaFunctions::values(piter->param(), *globals.queryinfo);
-
-      // Replace values if so requested
-
-      if (piter->replace())
-        vals.Replace(piter->replaceSourceValue(), piter->replaceTargetValue());
-
-      // Filter the values if so requested
-
-      filter_values(vals, t, *piter);
-
-      // Expand the data if so requested
-
-      if (globals.expanddata)
-        expand_data(vals);
-
-      // Call smoother only if necessary to avoid LazyCoordinates dereferencing
-
-      LazyCoordinates worldpts(*area);
-
-      if (piter->smoother() != "None")
-      {
-        NFmiSmoother smoother(piter->smoother(), piter->smootherFactor(), piter->smootherRadius());
-
-        vals = smoother.Smoothen(*worldpts, vals);
-      }
-
-      // Setup the contourer with the values
-
-      globals.calculator.data(vals);
-
-      // Save the data values at desired points for later
-      // use, this lets us avoid using InterpolatedValue()
-      // which does not use smoothened values.
-
-      // First, however, if this is the first image, we add
-      // the grid points to the set of points, if so requested
-
-      if (!labeldxdydone)
-        add_label_grid_values(*piter, *area, worldpts);
-
-      // For pixelgrids we must repeat the process for all new
-      // background images, since the pixel spacing changes
-      // every time. Note! We assume the following calling order!
-
-      add_label_point_values(*piter, *area, vals);
-      add_label_pixelgrid_values(*piter, *area, *xr, vals);
-
-      // Fill the contours
-
-      draw_contour_fills(*xr, *area, *piter, t, interp);
-
-      // Pattern fill the contours
-
-      draw_contour_patterns(*xr, *area, *piter, t, interp);
-
-      // Stroke the contours
-
-      draw_contour_strokes(*xr, *area, *piter, t, interp);
-
-      // Save contour symbol coordinates
-
-      save_contour_symbols(*xr, *area, *piter, worldpts, vals);
-
-      // Save symbol fill coordinates
-
-      save_contour_fonts(*xr, *area, *piter, worldpts, vals);
-
-      // Save contour label coordinates
-
-      save_contour_labels(*xr, *area, *piter, t, interp);
-
-      // Draw optional overlay
-
-      draw_overlay(*xr, *piter);
+        cout << "Not overwriting " << times[k].filename << endl;
+      continue;
     }
 
-    // Draw graticule
-
-    draw_graticule(*xr, *area);
-
-    // Bang the foreground
-
-    draw_foreground(*xr);
-
-    // Draw wind arrows if so requested
+    t = times[k].time;
+    const string &filename = times[k].filename;
 
-    draw_wind_arrows(*xr, *area);
+    // Set the data to the time, the parameters are chosen later
 
-    // Draw contour symbols
+    for (qi = 0; qi < globals.querystreams.size(); qi++)
+      globals.querystreams[qi]->SetTimeAtOrAfter(t);
 
-    draw_contour_symbols(*xr);
+    // Collect the prefetched values and start prefetching the next image
 
-    // Draw contour fonts
+    vector<NFmiDataMatrix<float>> prefetchedvalues;
+    if (prefetchedindex == k)
+      prefetchedvalues = prefetched.get();
 
-    draw_contour_fonts(*xr);
-
-    // Label the contours
-
-    draw_contour_labels(*xr);
-
-    // Draw labels
-
-    for (piter = pbegin; piter != pend; ++piter)
+    if (globals.prefetch)
     {
-      draw_label_markers(*xr, *piter, *area);
-      draw_label_texts(*xr, *piter, *area);
+      prefetchedindex = k + 1;
+      while (prefetchedindex < times.size() && times[prefetchedindex].skip)
+        ++prefetchedindex;
+      if (prefetchedindex < times.size())
+        prefetched = std::async(std::launch::async,
+                                prefetch_values,
+                                std::cref(clones),
+                                std::ref(cloneindex),
+                                std::cref(clonespecs),
+                                times[prefetchedindex].time,
+                                std::cref(*clonearea));
     }
 
-    // Draw high/low pressure markers
+    // Initialize the background
 
-    draw_pressure_markers(*xr, *area);
+    std::shared_ptr<ImagineXr_or_NFmiImage> image = create_image(*area, filename);
 
-    // Bang the combine image (legend, logo, whatever)
+    set_locator_boxes(context, *image);
 
-    globals.drawCombine(*xr);
+    // Render the contours, then the labels
 
-    // Finally, draw a time stamp on the image if so
-    // requested
+    render_contours(context, *image, *area, t, labeldxdydone, prefetchedvalues);
 
-    const string stamp = globals.getImageStampText(t);
-    globals.drawImageStampText(*xr, stamp);
+    render_labels(context, *image, *area, t);
 
     // dx and dy labels have now been extracted into a list,
     // disable adding them again and again and again..
@@ -5396,21 +6752,22 @@ void do_draw_contours(istream &theInput)
 
     // Save
 
-#ifdef IMAGINE_WITH_CAIRO
-    assert(xr->Filename() != "");
-    write_image(*xr);
-    delete xr;
-#else
-    write_image(*image, filename, globals.format);
-#endif
+    save_image(image, filename);
+
+    if (globals.verbose && globals.calculator.cacheEvictions() != evictions)
+    {
+      cout << "Evicted " << globals.calculator.cacheEvictions() - evictions
+           << " contours from the cache, " << globals.calculator.cacheBytes()
+           << " bytes remain cached" << endl;
+      evictions = globals.calculator.cacheEvictions();
+    }
 
     // Advance in time
 
-    globals.labellocator.nextTime();
-    globals.pressurelocator.nextTime();
-    globals.symbollocator.nextTime();
-    globals.imagelocator.nextTime();
+    next_time(context);
   }
+
+  report_cache_write_errors(cacheerrors);
 }
 
 /****/
@@ -5430,10 +6787,26 @@ static void process_cmd(const string &text)
       do_comment(in);
     else if (cmd == "cache")
       do_cache(in);
+    else if (cmd == "contourcache")
+      do_contourcache(in);
+    else if (cmd == "slicecache")
+      do_slicecache(in);
+    else if (cmd == "prefetch")
+      do_prefetch(in);
     else if (cmd == "imagecache")
       do_imagecache(in);
+    else if (cmd == "threads")
+      do_threads(in);
+    else if (cmd == "imagethreads")
+      do_imagethreads(in);
+    else if (cmd == "writethreads")
+      do_writethreads(in);
+    else if (cmd == "writequeue")
+      do_writequeue(in);
     else if (cmd == "querydata")
       do_querydata(in);
+    else if (cmd == "querydatapool")
+      do_querydatapool(in);
     else if (cmd == "filter")
       do_filter(in);
     else if (cmd == "timestepskip")
@@ -5543,6 +6916,8 @@ static void process_cmd(const string &text)
       do_savealpha(in);
     else if (cmd == "reducecolors")
       do_reducecolors(in);
+    else if (cmd == "knownpalette")
+      do_knownpalette(in);
     else if (cmd == "wantpalette")
       do_wantpalette(in);
     else if (cmd == "forcepalette")
@@ -5567,6 +6942,12 @@ static void process_cmd(const string &text)
       do_contourinterpolation(in);
     else if (cmd == "contourtriangles")
       do_contourtriangles(in);
+    else if (cmd == "contourtilesize")
+      do_contourtilesize(in);
+    else if (cmd == "contourviewport")
+      do_contourviewport(in);
+    else if (cmd == "contourviewportmargin")
+      do_contourviewportmargin(in);
     else if (cmd == "smoother")
       do_smoother(in);
     else if (cmd == "smootherradius")
@@ -5729,6 +7110,8 @@ int domain(int argc, const char *argv[])
 
     process_cmd(text);
   }
+
+  finish_writing();
   return 0;
 }
 
@@ -0,0 +1,70 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace AreaTools
+ */
+// ======================================================================
+
+#include "AreaTools.h"
+
+#include <gis/SpatialReference.h>
+#include <newbase/NFmiRect.h>
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append the raw bytes of a value into a buffer
+ */
+// ----------------------------------------------------------------------
+
+void append(std::string &theBuffer, double theValue)
+{
+  theBuffer.append(reinterpret_cast<const char *>(&theValue), sizeof(theValue));
+}
+
+void append(std::string &theBuffer, const NFmiPoint &thePoint)
+{
+  append(theBuffer, thePoint.X());
+  append(theBuffer, thePoint.Y());
+}
+
+void append(std::string &theBuffer, const NFmiRect &theRect)
+{
+  append(theBuffer, theRect.TopLeft());
+  append(theBuffer, theRect.BottomRight());
+}
+
+}  // namespace
+
+namespace AreaTools
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a string identifying the projection of an area
+ *
+ * Two areas with equal fingerprints project all points identically,
+ * hence the fingerprint can be used as a cache key for anything
+ * calculated for the area. The string is binary and not meant
+ * to be printed.
+ *
+ * \param theArea The area
+ * \return The fingerprint
+ */
+// ----------------------------------------------------------------------
+
+std::string fingerprint(const NFmiArea &theArea)
+{
+  std::string buffer;
+  append(buffer, static_cast<double>(theArea.ClassId()));
+  append(buffer, theArea.BottomLeftLatLon());
+  append(buffer, theArea.TopRightLatLon());
+  append(buffer, theArea.XYArea());
+  append(buffer, theArea.WorldRect());
+  buffer += theArea.SpatialReference().projStr();
+  return buffer;
+}
+
+}  // namespace AreaTools
+
+// ======================================================================
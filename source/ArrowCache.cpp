@@ -29,7 +29,11 @@ bool ArrowCache::empty() const { return itsCache.empty(); }
  */
 // ----------------------------------------------------------------------
 
-void ArrowCache::clear() { itsCache.clear(); }
+void ArrowCache::clear()
+{
+  lock_guard<mutex> lock(itsMutex);
+  itsCache.clear();
+}
 // ----------------------------------------------------------------------
 /*!
  * \brief Return the desired arrow from the cache
@@ -38,6 +42,8 @@ void ArrowCache::clear() { itsCache.clear(); }
 
 const string &ArrowCache::find(const string &theName)
 {
+  lock_guard<mutex> lock(itsMutex);
+
   cache_type::const_iterator it = itsCache.find(theName);
   if (it != itsCache.end()) return it->second;
 
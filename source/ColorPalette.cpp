@@ -0,0 +1,157 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class ColorPalette
+ */
+// ======================================================================
+
+#include "ColorPalette.h"
+
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace std;
+using namespace Imagine;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
+
+ColorPalette::ColorPalette() : itsColors() {}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add a color to the palette
+ *
+ * Adding stops once the palette has become unusable, since it
+ * will not be used anyway.
+ *
+ * \param theColor The color to add
+ */
+// ----------------------------------------------------------------------
+
+void ColorPalette::add(NFmiColorTools::Color theColor)
+{
+  if (usable())
+    itsColors.insert(theColor);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the colors of an image to the palette
+ *
+ * \param theColors The pixels of the image
+ * \param theCount The number of pixels
+ */
+// ----------------------------------------------------------------------
+
+void ColorPalette::add(const NFmiColorTools::Color *theColors, std::size_t theCount)
+{
+  for (std::size_t i = 0; i < theCount && usable(); i++)
+    add(theColors[i]);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of colors in the palette
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ColorPalette::size() const { return itsColors.size(); }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test if the palette may be used for reducing colors
+ *
+ * \return True if the palette is small enough
+ */
+// ----------------------------------------------------------------------
+
+bool ColorPalette::usable() const { return itsColors.size() <= MaxColors; }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest color in the palette
+ *
+ * The distance is measured in RGBA space, the alpha channel is
+ * scaled to the same range as the color channels.
+ *
+ * \param theColor The color to map
+ * \return The nearest color in the palette
+ */
+// ----------------------------------------------------------------------
+
+NFmiColorTools::Color ColorPalette::nearest(NFmiColorTools::Color theColor) const
+{
+  const int r = NFmiColorTools::GetRed(theColor);
+  const int g = NFmiColorTools::GetGreen(theColor);
+  const int b = NFmiColorTools::GetBlue(theColor);
+  const int a = NFmiColorTools::GetAlpha(theColor);
+
+  NFmiColorTools::Color best = theColor;
+  int bestdist = numeric_limits<int>::max();
+
+  for (set<NFmiColorTools::Color>::const_iterator it = itsColors.begin(); it != itsColors.end();
+       ++it)
+  {
+    const int dr = NFmiColorTools::GetRed(*it) - r;
+    const int dg = NFmiColorTools::GetGreen(*it) - g;
+    const int db = NFmiColorTools::GetBlue(*it) - b;
+    const int da = 2 * (NFmiColorTools::GetAlpha(*it) - a);
+    const int dist = dr * dr + dg * dg + db * db + da * da;
+    if (dist < bestdist)
+    {
+      best = *it;
+      bestdist = dist;
+      if (dist == 0)
+        break;
+    }
+  }
+  return best;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Reduce the colors of an image to the palette
+ *
+ * Each distinct color is searched for only once. Since the images
+ * consist mostly of runs of identical colors, the previous pixel
+ * is checked first.
+ *
+ * \param theImage The image to modify
+ */
+// ----------------------------------------------------------------------
+
+void ColorPalette::reduce(NFmiImage &theImage) const
+{
+  if (!usable() || itsColors.empty())
+    throw runtime_error("ColorPalette: cannot reduce colors with an unusable palette");
+
+  unordered_map<NFmiColorTools::Color, NFmiColorTools::Color> lookup;
+
+  NFmiColorTools::Color previous = theImage(0, 0);
+  NFmiColorTools::Color mapped = nearest(previous);
+  lookup[previous] = mapped;
+
+  for (int j = 0; j < theImage.Height(); j++)
+    for (int i = 0; i < theImage.Width(); i++)
+    {
+      NFmiColorTools::Color &color = theImage(i, j);
+      if (color != previous)
+      {
+        previous = color;
+        unordered_map<NFmiColorTools::Color, NFmiColorTools::Color>::const_iterator it =
+            lookup.find(color);
+        if (it != lookup.end())
+          mapped = it->second;
+        else
+        {
+          mapped = nearest(color);
+          lookup[color] = mapped;
+        }
+      }
+      color = mapped;
+    }
+}
+
+// ======================================================================
@@ -10,39 +10,134 @@
 
 #include <newbase/NFmiTime.h>
 
-#include <sstream>
+#include <functional>
+#include <stdexcept>
 
 using namespace std;
 
 namespace
 {
+// ----------------------------------------------------------------------
+/*!
+ * \brief Approximate memory used by a path
+ */
+// ----------------------------------------------------------------------
+
+std::size_t path_bytes(const Imagine::NFmiPath &thePath)
+{
+  return sizeof(Imagine::NFmiPath) +
+         thePath.Elements().size() * sizeof(Imagine::NFmiPathData::value_type);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Pack a time into an integer of the form YYYYMMDDHHMM
+ */
+// ----------------------------------------------------------------------
+
+long long pack_time(const NFmiTime &theTime)
+{
+  return ((((theTime.GetYear() * 100LL + theTime.GetMonth()) * 100 + theTime.GetDay()) * 100 +
+           theTime.GetHour()) *
+              100 +
+          theTime.GetMin());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Combine a hash value into a seed
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+void hash_combine(std::size_t &theSeed, const T &theValue)
+{
+  theSeed ^= std::hash<T>()(theValue) + 0x9e3779b9 + (theSeed << 6) + (theSeed >> 2);
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test two keys for equality
+ */
+// ----------------------------------------------------------------------
+
+bool ContourCache::Key::operator==(const Key &theOther) const
+{
+  return (lolimit == theOther.lolimit && hilimit == theOther.hilimit &&
+          isoline == theOther.isoline && param == theOther.param && level == theOther.level &&
+          time == theOther.time && origintime == theOther.origintime && file == theOther.file &&
+          simplify == theOther.simplify && window == theOther.window && area == theOther.area);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hash a key
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ContourCache::KeyHash::operator()(const Key &theKey) const
+{
+  std::size_t seed = 0;
+  hash_combine(seed, theKey.lolimit);
+  hash_combine(seed, theKey.hilimit);
+  hash_combine(seed, theKey.isoline);
+  hash_combine(seed, theKey.param);
+  hash_combine(seed, theKey.level);
+  hash_combine(seed, theKey.time);
+  hash_combine(seed, theKey.origintime);
+  hash_combine(seed, theKey.file);
+  hash_combine(seed, theKey.simplify);
+  if (!theKey.window.empty())
+    hash_combine(seed, theKey.window);
+  if (!theKey.area.empty())
+    hash_combine(seed, theKey.area);
+  return seed;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
+
+ContourCache::ContourCache() : itsData(), itsOrder(), itsBytes(0), itsMaxBytes(0), itsEvictions(0)
+{
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Return a cache-key for the given contour settings
  *
  * \param theLoLimit The lower limit of the contour
  * \param theHiLimit The upper limit of the contour
- * \param theTime The actual data time which may be interpolated
+ * \param theTime The actual data time may be interpolated (<> ValidTime)
  * \param theData The query data
+ * \param theWindow The contoured grid window, empty for the full grid
  * \return The key for the data in the cache
  */
 // ----------------------------------------------------------------------
 
-std::string cache_key(float theLoLimit,
-                      float theHiLimit,
-                      const NFmiTime &theTime,
-                      const LazyQueryData &theData)
+ContourCache::Key ContourCache::key(float theLoLimit,
+                                    float theHiLimit,
+                                    const NFmiTime &theTime,
+                                    const LazyQueryData &theData,
+                                    const std::string &theWindow)
 {
-  ostringstream os;
-
-  os << theLoLimit << '_' << theHiLimit << '_' << theData.Filename() << '_'
-     << theTime.ToStr(kYYYYMMDDHHMM).CharPtr() << '_'
-     << theData.OriginTime().ToStr(kYYYYMMDDHHMM).CharPtr() << '_' << theData.GetParamName() << '_'
-     << theData.GetParamIdent() << '_' << theData.GetLevelNumber();
-
-  return os.str();
+  Key key;
+  key.lolimit = theLoLimit;
+  key.hilimit = theHiLimit;
+  key.isoline = false;
+  key.param = theData.GetParamIdent();
+  key.level = theData.GetLevelNumber();
+  key.time = pack_time(theTime);
+  key.origintime = pack_time(theData.OriginTime());
+  key.file = theData.Filename();
+  key.window = theWindow;
+  key.simplify = 0;
+  return key;
 }
-}  // namespace
 
 // ----------------------------------------------------------------------
 /*!
@@ -59,7 +154,12 @@ bool ContourCache::empty() const { return itsData.empty(); }
  */
 // ----------------------------------------------------------------------
 
-void ContourCache::clear() { itsData.clear(); }
+void ContourCache::clear()
+{
+  itsData.clear();
+  itsOrder.clear();
+  itsBytes = 0;
+}
 // ----------------------------------------------------------------------
 /*!
  * \brief Return the number of cached contours
@@ -71,77 +171,95 @@ void ContourCache::clear() { itsData.clear(); }
 ContourCache::size_type ContourCache::size() const { return itsData.size(); }
 // ----------------------------------------------------------------------
 /*!
- * \brief Test if given contour is cached
+ * \brief Find a cached contour
  *
- * \param theLoLimit The lower limit of the contour
- * \param theHiLimit The upper limit of the contour
- * \param theTime The actual data time may be interpolated (<> ValidTime)
- * \param theData The query data
+ * \param theKey The key of the contour
+ * \return The cached path, or nullptr if the contour is not cached
  */
 // ----------------------------------------------------------------------
 
-bool ContourCache::contains(float theLoLimit,
-                            float theHiLimit,
-                            const NFmiTime &theTime,
-                            const LazyQueryData &theData) const
+const Imagine::NFmiPath *ContourCache::find(const Key &theKey)
 {
-  string key = cache_key(theLoLimit, theHiLimit, theTime, theData);
-  storage_type::const_iterator it = itsData.find(key);
-  return (it != itsData.end());
+  storage_type::iterator it = itsData.find(theKey);
+  if (it == itsData.end()) return nullptr;
+
+  // Mark as most recently used
+  itsOrder.splice(itsOrder.begin(), itsOrder, it->second.position);
+
+  return &it->second.path;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Find the given cached contour
+ * \brief Set the memory budget of the cache
  *
- * This will throw if the contour is not cached
+ * \param theBytes The maximum approximate size of the stored paths, 0 for no limit
+ */
+// ----------------------------------------------------------------------
+
+void ContourCache::maxBytes(std::size_t theBytes)
+{
+  itsMaxBytes = theBytes;
+  evict();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Evict least recently used contours until within budget
  *
- * \param theLoLimit The lower limit of the contour
- * \param theHiLimit The upper limit of the contour
- * \param theTime The actual data time may be interpolated (<> ValidTime)
- * \param theData The query data
- * \return The path
+ * The most recently used contour is never evicted, even if it
+ * alone exceeds the budget, since the caller holds a reference to it.
  */
 // ----------------------------------------------------------------------
 
-const Imagine::NFmiPath &ContourCache::find(float theLoLimit,
-                                            float theHiLimit,
-                                            const NFmiTime &theTime,
-                                            const LazyQueryData &theData) const
+void ContourCache::evict()
 {
-  string key = cache_key(theLoLimit, theHiLimit, theTime, theData);
-  storage_type::const_iterator it = itsData.find(key);
-  if (it != itsData.end()) return it->second;
-  throw runtime_error("Contour was not in the cache - use contains first!");
+  if (itsMaxBytes == 0)
+    return;
+
+  while (itsBytes > itsMaxBytes && itsOrder.size() > 1)
+  {
+    storage_type::iterator it = itsData.find(*itsOrder.back());
+    itsBytes -= it->second.bytes;
+    itsOrder.pop_back();
+    itsData.erase(it);
+    ++itsEvictions;
+  }
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Insert a new path into the cache
+ * \brief Insert a new contour into the cache
  *
- * This will throw if the contour is already cached
+ * Throws if the contour is already in the cache. Least recently
+ * used contours are evicted if the memory budget is exceeded.
  *
- * \param thePath The path to cache
- * \param theLoLimit The lower limit of the contour
- * \param theHiLimit The upper limit of the contour
- * \param theTime The actual data time may be interpolated (<> ValidTime)
- * \param theData The query data
+ * \param theKey The key of the contour
+ * \param thePath The path to insert
+ * \return The cached path
  */
 // ----------------------------------------------------------------------
 
-void ContourCache::insert(const Imagine::NFmiPath &thePath,
-                          float theLoLimit,
-                          float theHiLimit,
-                          const NFmiTime &theTime,
-                          const LazyQueryData &theData)
+const Imagine::NFmiPath &ContourCache::insert(const Key &theKey, const Imagine::NFmiPath &thePath)
 {
-  string key = cache_key(theLoLimit, theHiLimit, theTime, theData);
+  typedef pair<storage_type::iterator, bool> restype;
 
-  typedef pair<storage_type::const_iterator, bool> restype;
+  Entry entry;
+  entry.bytes = path_bytes(thePath);
 
-  restype result = itsData.insert(storage_type::value_type(key, thePath));
+  restype result = itsData.insert(storage_type::value_type(theKey, entry));
 
   if (!result.second) throw runtime_error("Contour was already in the cache!");
+
+  result.first->second.path = thePath;
+
+  itsOrder.push_front(&result.first->first);
+  result.first->second.position = itsOrder.begin();
+  itsBytes += entry.bytes;
+
+  evict();
+
+  return result.first->second.path;
 }
 
 // ======================================================================
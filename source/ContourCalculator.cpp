@@ -6,14 +6,20 @@
 // ======================================================================
 
 #include "ContourCalculator.h"
+#include "AreaTools.h"
 #include "ContourCache.h"
+#include "ContourDiskCache.h"
 #include "DataMatrixAdapter.h"
 #include "LazyQueryData.h"
+#include "ParallelTools.h"
+#include <geos/util/GEOSException.h>
 #include <geos/version.h>
 #include <newbase/NFmiDataMatrix.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiMetTime.h>
+#include <algorithm>
 #include <memory>
+#include <sstream>
 #include <stdexcept>
 
 #include <tron/FmiBuilder.h>
@@ -42,9 +48,35 @@ using namespace geos::geom;
 
 void add_path(Imagine::NFmiPath &path, const Geometry *geom);
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append the first n coordinates of a sequence as a subpath
+ *
+ * The coordinates are read directly from the sequence of the
+ * geometry to avoid the range checks and casts of getCoordinateN.
+ */
+// ----------------------------------------------------------------------
+
+void add_coordinates(Imagine::NFmiPath &path, const CoordinateSequence &coords, std::size_t n)
+{
+  if (n == 0)
+    return;
+
+  const Coordinate &first = coords.getAt(0);
+  path.MoveTo(first.x, first.y);
+
+  for (std::size_t i = 1; i < n; ++i)
+  {
+    const Coordinate &coord = coords.getAt(i);
+    path.LineTo(coord.x, coord.y);
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle LinearRing
+ *
+ * The closing point is omitted, rendering closes the ring anyway.
  */
 // ----------------------------------------------------------------------
 
@@ -53,14 +85,8 @@ void add_linearring(Imagine::NFmiPath &path, const LinearRing *geom)
   if (geom == nullptr || geom->isEmpty())
     return;
 
-  for (unsigned long i = 0, n = geom->getNumPoints(); i < n - 1; ++i)
-  {
-    const Coordinate &coord = geom->getCoordinateN(boost::numeric_cast<int>(i));
-    if (i == 0)
-      path.MoveTo(coord.x, coord.y);
-    else
-      path.LineTo(coord.x, coord.y);
-  }
+  const CoordinateSequence *coords = geom->getCoordinatesRO();
+  add_coordinates(path, *coords, coords->getSize() - 1);
 }
 
 // ----------------------------------------------------------------------
@@ -74,16 +100,8 @@ void add_linestring(Imagine::NFmiPath &path, const LineString *geom)
   if (geom == nullptr || geom->isEmpty())
     return;
 
-  unsigned long n = geom->getNumPoints();
-
-  for (unsigned long i = 0; i < n; ++i)
-  {
-    const Coordinate &coord = geom->getCoordinateN(boost::numeric_cast<int>(i));
-    if (i == 0)
-      path.MoveTo(coord.x, coord.y);
-    else
-      path.LineTo(coord.x, coord.y);
-  }
+  const CoordinateSequence *coords = geom->getCoordinatesRO();
+  add_coordinates(path, *coords, coords->getSize());
 }
 
 // ----------------------------------------------------------------------
@@ -115,7 +133,7 @@ void add_multilinestring(Imagine::NFmiPath &path, const MultiLineString *geom)
     return;
 
   for (size_t i = 0, n = geom->getNumGeometries(); i < n; ++i)
-    add_linestring(path, dynamic_cast<const LineString *>(geom->getGeometryN(i)));
+    add_linestring(path, static_cast<const LineString *>(geom->getGeometryN(i)));
 }
 
 // ----------------------------------------------------------------------
@@ -130,7 +148,7 @@ void add_multipolygon(Imagine::NFmiPath &path, const MultiPolygon *geom)
     return;
 
   for (size_t i = 0, n = geom->getNumGeometries(); i < n; ++i)
-    add_polygon(path, dynamic_cast<const Polygon *>(geom->getGeometryN(i)));
+    add_polygon(path, static_cast<const Polygon *>(geom->getGeometryN(i)));
 }
 
 // ----------------------------------------------------------------------
@@ -151,27 +169,145 @@ void add_geometrycollection(Imagine::NFmiPath &path, const GeometryCollection *g
 // ----------------------------------------------------------------------
 /*!
  * \brief Convert a GEOS geometry to legacy NFmiPath
+ *
+ * The type is resolved once from the type id instead of trying
+ * a chain of dynamic casts for every component.
  */
 // ----------------------------------------------------------------------
 
 void add_path(Imagine::NFmiPath &path, const Geometry *geom)
 {
-  if (const LinearRing *lr = dynamic_cast<const LinearRing *>(geom))
-    add_linearring(path, lr);
-  else if (const LineString *ls = dynamic_cast<const LineString *>(geom))
-    add_linestring(path, ls);
-  else if (const Polygon *p = dynamic_cast<const Polygon *>(geom))
-    add_polygon(path, p);
-  else if (const MultiLineString *ml = dynamic_cast<const MultiLineString *>(geom))
-    add_multilinestring(path, ml);
-  else if (const MultiPolygon *mpg = dynamic_cast<const MultiPolygon *>(geom))
-    add_multipolygon(path, mpg);
-  else if (const GeometryCollection *g = dynamic_cast<const GeometryCollection *>(geom))
-    add_geometrycollection(path, g);
-  else
-    throw std::runtime_error("Bad shit");
+  switch (geom->getGeometryTypeId())
+  {
+    case GEOS_LINEARRING:
+      return add_linearring(path, static_cast<const LinearRing *>(geom));
+    case GEOS_LINESTRING:
+      return add_linestring(path, static_cast<const LineString *>(geom));
+    case GEOS_POLYGON:
+      return add_polygon(path, static_cast<const Polygon *>(geom));
+    case GEOS_MULTILINESTRING:
+      return add_multilinestring(path, static_cast<const MultiLineString *>(geom));
+    case GEOS_MULTIPOLYGON:
+      return add_multipolygon(path, static_cast<const MultiPolygon *>(geom));
+    case GEOS_GEOMETRYCOLLECTION:
+      return add_geometrycollection(path, static_cast<const GeometryCollection *>(geom));
+    default:
+      // Points and multipoints cannot be rendered as paths
+      throw std::runtime_error("Cannot convert a point geometry to a path");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief GEOS geometry factory holder
+ *
+ * The factory must outlive all the geometries it has created.
+ */
+// ----------------------------------------------------------------------
+
+#if GEOS_VERSION_MAJOR == 3
+#if GEOS_VERSION_MINOR < 7
+typedef std::shared_ptr<GeometryFactory> MyGeometryFactory;
+#else
+typedef geos::geom::GeometryFactory::Ptr MyGeometryFactory;
+#endif
+#else
+#pragma message(Cannot handle current GEOS version correctly)
+#endif
+
+MyGeometryFactory create_factory()
+{
+#if GEOS_VERSION_MINOR < 7
+  return std::make_shared<GeometryFactory>();
+#else
+  return MyGeometryFactory(geos::geom::GeometryFactory::create());
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate a fill contour of the given grid as a geometry
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Geometry> fill_geometry(const MyGeometryFactory &theFactory,
+                                        const DataMatrixAdapter &theData,
+                                        const MyHints &theHints,
+                                        float theLoLimit,
+                                        float theHiLimit,
+                                        ContourInterpolation theInterpolation)
+{
+#if GEOS_VERSION_MINOR < 7
+  Tron::FmiBuilder builder(theFactory);
+#else
+  Tron::FmiBuilder builder(*theFactory);
+#endif
+
+  switch (theInterpolation)
+  {
+    case Linear:
+    case Missing:
+    {
+      MyLinearContourer::fill(builder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+    case LogLinear:
+    {
+      MyLogLinearContourer::fill(builder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+    case Nearest:
+    {
+      MyNearestContourer::fill(builder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+    case Discrete:
+    {
+      MyDiscreteContourer::fill(builder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+  }
+
+  std::shared_ptr<Geometry> geom = builder.result();
+  return geom;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Merge the given polygons into one geometry
+ *
+ * The geometries are merged pairwise so that the intermediate
+ * results stay small. Adjacent tiles are merged first.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Geometry> merge_geometries(std::vector<std::shared_ptr<Geometry> > theParts,
+                                           unsigned int theThreadCount)
+{
+  while (theParts.size() > 1)
+  {
+    std::vector<std::shared_ptr<Geometry> > merged((theParts.size() + 1) / 2);
+
+    ParallelTools::run(merged.size(),
+                       theThreadCount,
+                       [&](std::size_t i)
+                       {
+                         const std::size_t k = 2 * i;
+                         if (k + 1 >= theParts.size())
+                           merged[i] = theParts[k];
+                         else if (theParts[k]->isEmpty())
+                           merged[i] = theParts[k + 1];
+                         else if (theParts[k + 1]->isEmpty())
+                           merged[i] = theParts[k];
+                         else
+                           merged[i] = std::shared_ptr<Geometry>(
+                               theParts[k]->Union(theParts[k + 1].get()));
+                       });
+
+    theParts.swap(merged);
+  }
 
-  // We ignore points, multipoints and unknown types
+  return theParts.front();
 }
 
 // ----------------------------------------------------------------------
@@ -184,24 +320,81 @@ class ContourCalculatorPimple
 {
  public:
   ContourCalculatorPimple()
-      : itsAreaCache(),
-        itsLineCache(),
+      : itsCache(),
+        itsDiskCache(),
+        itsDiskCacheErrors(0),
         isCacheOn(false),
         itWasCached(false),
+        itsCacheStates(),
+        itsThreadCount(1),
         itsData(),
-        itsHintsOK(false)
+        itsHintsOK(false),
+        itsExtremaOK(false),
+        itHasValues(false),
+        itsMinValue(kFloatMissing),
+        itsMaxValue(kFloatMissing),
+        itsTileSize(0),
+        itsTilesOK(false),
+        itsGrid(),
+        itsWindow(),
+        itsPath(),
+        itsValueHashOK(false),
+        itsValueHash(0)
   {
   }
 
-  ContourCache itsAreaCache;
-  ContourCache itsLineCache;
+  ContourCache itsCache;
+  ContourDiskCache itsDiskCache;
+  std::size_t itsDiskCacheErrors;  // failed writes into the disk cache
   bool isCacheOn;
   bool itWasCached;
-  std::shared_ptr<DataMatrixAdapter> itsData;  // does not own!
+  ContourCalculator::CacheStates itsCacheStates;  // states of the latest batch
+  unsigned int itsThreadCount;
+  std::shared_ptr<DataMatrixAdapter> itsData;  // active grid or window
   bool itsHintsOK;
   std::shared_ptr<MyHints> itsHints;
 
+  bool itsExtremaOK;
+  bool itHasValues;
+  float itsMinValue;
+  float itsMaxValue;
+
+  std::size_t itsTileSize;
+  bool itsTilesOK;
+  std::vector<std::shared_ptr<DataMatrixAdapter> > itsTiles;
+  std::vector<std::shared_ptr<MyHints> > itsTileHints;
+
+  std::shared_ptr<DataMatrixAdapter> itsGrid;  // full grid
+  std::string itsWindow;                       // empty for the full grid
+
+  Imagine::NFmiPath itsPath;  // latest result when not caching
+
+  bool itsValueHashOK;
+  std::uint64_t itsValueHash;
+
   void require_hints();
+  void require_extrema();
+  void require_tiles();
+  bool may_contain(float theLoLimit, float theHiLimit);
+  void store(std::vector<Imagine::NFmiPath> &thePaths,
+             const std::vector<ContourCache::Key> &theKeys,
+             const std::vector<std::string> &theDiskKeys,
+             const ContourCalculator::CacheStates &theStates,
+             const LazyQueryData &theData);
+  std::string disk_key(const ContourCache::Key &theKey,
+                       ContourInterpolation theInterpolation,
+                       const LazyQueryData &theData);
+  bool tiled() const;
+
+  Imagine::NFmiPath fill(float theLoLimit,
+                         float theHiLimit,
+                         ContourInterpolation theInterpolation,
+                         unsigned int theThreadCount);
+  Imagine::NFmiPath fill_tiled(float theLoLimit,
+                               float theHiLimit,
+                               ContourInterpolation theInterpolation,
+                               unsigned int theThreadCount);
+  Imagine::NFmiPath line(float theValue, ContourInterpolation theInterpolation);
 
 };  // class ContourCalculatorPimple
 
@@ -222,187 +415,302 @@ void ContourCalculatorPimple::require_hints()
 
 // ----------------------------------------------------------------------
 /*!
- *\brief Destructor
+ * \brief Test whether fill contours are calculated in tiles
  */
 // ----------------------------------------------------------------------
 
-ContourCalculator::~ContourCalculator() {}
+bool ContourCalculatorPimple::tiled() const
+{
+  if (itsTileSize == 0)
+    return false;
+
+  return (itsData->width() > itsTileSize + 1 || itsData->height() > itsTileSize + 1);
+}
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Constructor
+ * \brief Require the tiles and their hints to be up to date
+ *
+ * Each tile covers at most itsTileSize x itsTileSize grid cells.
+ * Adjacent tiles share the grid points on their common edge, so that
+ * every grid cell belongs to exactly one tile and the union of the
+ * tile contours is equal to the contour of the full grid.
  */
 // ----------------------------------------------------------------------
 
-ContourCalculator::ContourCalculator()
+void ContourCalculatorPimple::require_tiles()
 {
-  itsPimple.reset(new ContourCalculatorPimple());
+  if (itsTilesOK)
+    return;
+
+  itsTiles.clear();
+  itsTileHints.clear();
+
+  const DataMatrixAdapter::size_type nx = itsData->width();
+  const DataMatrixAdapter::size_type ny = itsData->height();
+
+  for (DataMatrixAdapter::size_type j1 = 0; j1 + 1 < ny; j1 += itsTileSize)
+  {
+    const DataMatrixAdapter::size_type j2 = std::min(j1 + itsTileSize, ny - 1);
+
+    for (DataMatrixAdapter::size_type i1 = 0; i1 + 1 < nx; i1 += itsTileSize)
+    {
+      const DataMatrixAdapter::size_type i2 = std::min(i1 + itsTileSize, nx - 1);
+
+      std::shared_ptr<DataMatrixAdapter> tile(
+          new DataMatrixAdapter(*itsData, i1, j1, i2 - i1 + 1, j2 - j1 + 1));
+
+      itsTiles.push_back(tile);
+      itsTileHints.push_back(std::shared_ptr<MyHints>(new MyHints(*tile)));
+    }
+  }
+
+  itsTilesOK = true;
 }
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Clear the cache
+ * \brief Finish and cache the results of a batch contouring
+ *
+ * Newly calculated paths are converted from grid coordinates and
+ * stored into the disk cache, and all paths not already in the
+ * memory cache are stored there. The states are kept for
+ * cacheStates(). Sets itWasCached to true only
+ * if all the contours were found from the caches.
  */
 // ----------------------------------------------------------------------
 
-void ContourCalculator::clearCache()
+void ContourCalculatorPimple::store(std::vector<Imagine::NFmiPath> &thePaths,
+                                    const std::vector<ContourCache::Key> &theKeys,
+                                    const std::vector<std::string> &theDiskKeys,
+                                    const ContourCalculator::CacheStates &theStates,
+                                    const LazyQueryData &theData)
 {
-  itsPimple->itsAreaCache.clear();
-  itsPimple->itsLineCache.clear();
+  bool allcached = true;
+
+  for (std::size_t i = 0; i < thePaths.size(); i++)
+  {
+    if (theStates[i] == ContourCalculator::MemoryCached)
+      continue;
+
+    if (theStates[i] == ContourCalculator::NotCached)
+    {
+      allcached = false;
+      thePaths[i].InvGrid(theData.Grid());
+      if (itsDiskCache.enabled())
+        if (!itsDiskCache.insert(theDiskKeys[i], thePaths[i]))
+          ++itsDiskCacheErrors;
+    }
+
+    // The same contour may be requested twice
+
+    if (isCacheOn && itsCache.find(theKeys[i]) == nullptr)
+      itsCache.insert(theKeys[i], thePaths[i]);
+  }
+
+  itWasCached = allcached;
+  itsCacheStates = theStates;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Set the cache on or off
+ * \brief Return the disk cache key for a contour
  *
- * \param theFlag True if cache is to be set on
+ * The hash of the full grid values is calculated only once for
+ * the active data, and only when the first contour is missing from
+ * the memory cache. Callers must look up the memory cache first.
  */
 // ----------------------------------------------------------------------
 
-void ContourCalculator::cache(bool theFlag)
+std::string ContourCalculatorPimple::disk_key(const ContourCache::Key &theKey,
+                                              ContourInterpolation theInterpolation,
+                                              const LazyQueryData &theData)
 {
-  itsPimple->isCacheOn = theFlag;
+  if (!itsValueHashOK)
+  {
+    itsValueHash = 0;
+    for (DataMatrixAdapter::size_type j = 0; j < itsGrid->height(); j++)
+      itsValueHash = ContourDiskCache::hash(itsGrid->row(j), itsGrid->width(), itsValueHash);
+    itsValueHashOK = true;
+  }
+
+  // Isolines are never tiled
+
+  const std::size_t tilesize = (theKey.isoline || !tiled() ? 0 : itsTileSize);
+
+  return ContourDiskCache::key(theKey, theInterpolation, theData, itsValueHash, tilesize);
 }
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Return whether the last contour was cached
+ * \brief Require the data extrema to be up to date
  *
- * \return True, if last returned contour was cached
+ * The extrema are established with a single pass over the grid,
+ * after which any number of contour ranges can be classified
+ * against them without touching the grid again.
  */
 // ----------------------------------------------------------------------
 
-bool ContourCalculator::wasCached() const
+void ContourCalculatorPimple::require_extrema()
 {
-  return itsPimple->itWasCached;
+  if (itsExtremaOK)
+    return;
+
+  const DataMatrixAdapter &data = *itsData;
+
+  itHasValues = false;
+  itsMinValue = kFloatMissing;
+  itsMaxValue = kFloatMissing;
+
+  for (DataMatrixAdapter::size_type j = 0; j < data.height(); j++)
+  {
+    const float *row = data.row(j);
+    for (DataMatrixAdapter::size_type i = 0; i < data.width(); i++)
+    {
+      const float value = row[i];
+      if (value == kFloatMissing)
+        continue;
+      if (!itHasValues)
+      {
+        itsMinValue = value;
+        itsMaxValue = value;
+        itHasValues = true;
+      }
+      else
+      {
+        itsMinValue = std::min(itsMinValue, value);
+        itsMaxValue = std::max(itsMaxValue, value);
+      }
+    }
+  }
+
+  itsExtremaOK = true;
 }
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Set new active data on
+ * \brief Test whether the given contour range may intersect the data
+ *
+ * A range whose limits are both missing selects the missing values,
+ * and is hence always contoured. Otherwise the range is rejected
+ * if it lies completely outside the data extrema.
+ *
+ * \param theLoLimit The lower limit of the range
+ * \param theHiLimit The upper limit of the range
+ * \return False if the contour is known to be empty
  */
 // ----------------------------------------------------------------------
 
-void ContourCalculator::data(const NFmiDataMatrix<float> &theData)
+bool ContourCalculatorPimple::may_contain(float theLoLimit, float theHiLimit)
 {
-  itsPimple->itsData.reset(new DataMatrixAdapter(theData));
-  itsPimple->itsHintsOK = false;
+  if (theLoLimit == kFloatMissing && theHiLimit == kFloatMissing)
+    return true;
+
+  require_extrema();
+
+  if (!itHasValues)
+    return false;
+  if (theLoLimit != kFloatMissing && theLoLimit > itsMaxValue)
+    return false;
+  if (theHiLimit != kFloatMissing && theHiLimit < itsMinValue)
+    return false;
+  return true;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Return the desired contour
+ * \brief Calculate a fill contour in grid coordinates
  *
- *\return The path object
+ * Large grids are contoured in tiles if so requested. Should GEOS
+ * fail to merge the tiles, the full grid is contoured instead.
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
-                                             float theLoLimit,
-                                             float theHiLimit,
-                                             const NFmiTime &theTime,
-                                             ContourInterpolation theInterpolation)
+Imagine::NFmiPath ContourCalculatorPimple::fill(float theLoLimit,
+                                                float theHiLimit,
+                                                ContourInterpolation theInterpolation,
+                                                unsigned int theThreadCount)
 {
-  if (itsPimple->itsData.get() == 0)
-    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
-
-  if (itsPimple->isCacheOn &&
-      itsPimple->itsAreaCache.contains(theLoLimit, theHiLimit, theTime, theData))
-  {
-    itsPimple->itWasCached = true;
-    return itsPimple->itsAreaCache.find(theLoLimit, theHiLimit, theTime, theData);
-  }
-
-  itsPimple->require_hints();
-
-  // Build the contours
-
-#if GEOS_VERSION_MAJOR == 3
-#if GEOS_VERSION_MINOR < 7
-  std::shared_ptr<GeometryFactory> geomFactory = std::make_shared<GeometryFactory>();
-  Tron::FmiBuilder builder(geomFactory);
-#else
-  geos::geom::GeometryFactory::Ptr geomFactory(geos::geom::GeometryFactory::create());
-  Tron::FmiBuilder builder(*geomFactory);
-#endif
-#else
-#pragma message(Cannot handle current GEOS version correctly)
-#endif
-
-  switch (theInterpolation)
+  if (tiled())
   {
-    case Linear:
-    case Missing:
-    {
-      MyLinearContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
-    }
-    case LogLinear:
-    {
-      MyLogLinearContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
-    }
-    case Nearest:
+    try
     {
-      MyNearestContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
+      return fill_tiled(theLoLimit, theHiLimit, theInterpolation, theThreadCount);
     }
-    case Discrete:
+    catch (const geos::util::GEOSException &)
     {
-      MyDiscreteContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
+      // The merge may fail on degenerate seams, contour the full grid instead
     }
   }
 
-  auto geom = builder.result();
+  require_hints();
+
+  MyGeometryFactory factory = create_factory();
+  std::shared_ptr<Geometry> geom =
+      fill_geometry(factory, *itsData, *itsHints, theLoLimit, theHiLimit, theInterpolation);
 
   Imagine::NFmiPath path;
   add_path(path, geom.get());
-
-  path.InvGrid(theData.Grid());
-
-  if (itsPimple->isCacheOn)
-    itsPimple->itsAreaCache.insert(path, theLoLimit, theHiLimit, theTime, theData);
-
-  itsPimple->itWasCached = false;
   return path;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Return the desired contour line
+ * \brief Calculate a fill contour in tiles
  *
- *\return The path object
+ * The tiles are contoured independently and the polygons are then
+ * merged across the seams.
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
-                                             float theValue,
-                                             const NFmiTime &theTime,
-                                             ContourInterpolation theInterpolation)
+Imagine::NFmiPath ContourCalculatorPimple::fill_tiled(float theLoLimit,
+                                                      float theHiLimit,
+                                                      ContourInterpolation theInterpolation,
+                                                      unsigned int theThreadCount)
 {
-  if (itsPimple->itsData.get() == 0)
-    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+  require_tiles();
+
+  std::vector<MyGeometryFactory> factories(itsTiles.size());
+  std::vector<std::shared_ptr<Geometry> > parts(itsTiles.size());
+
+  ParallelTools::run(itsTiles.size(),
+                     theThreadCount,
+                     [&](std::size_t i)
+                     {
+                       factories[i] = create_factory();
+                       parts[i] = fill_geometry(factories[i],
+                                                *itsTiles[i],
+                                                *itsTileHints[i],
+                                                theLoLimit,
+                                                theHiLimit,
+                                                theInterpolation);
+                     });
+
+  std::shared_ptr<Geometry> geom = merge_geometries(parts, theThreadCount);
+  parts.clear();
 
-  if (itsPimple->isCacheOn &&
-      itsPimple->itsLineCache.contains(theValue, kFloatMissing, theTime, theData))
-  {
-    itsPimple->itWasCached = true;
-    return itsPimple->itsLineCache.find(theValue, kFloatMissing, theTime, theData);
-  }
+  Imagine::NFmiPath path;
+  add_path(path, geom.get());
+  geom.reset();
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate a contour line in grid coordinates
+ */
+// ----------------------------------------------------------------------
 
-  itsPimple->require_hints();
+Imagine::NFmiPath ContourCalculatorPimple::line(float theValue,
+                                                ContourInterpolation theInterpolation)
+{
+  require_hints();
 
-#if GEOS_VERSION_MAJOR == 3
+  MyGeometryFactory geomFactory = create_factory();
 #if GEOS_VERSION_MINOR < 7
-  std::shared_ptr<GeometryFactory> geomFactory = std::make_shared<GeometryFactory>();
   Tron::FmiBuilder builder(geomFactory);
 #else
-  geos::geom::GeometryFactory::Ptr geomFactory(geos::geom::GeometryFactory::create());
   Tron::FmiBuilder builder(*geomFactory);
-#endif
-#else
-#pragma message(Cannot handle current GEOS version correctly)
 #endif
 
   switch (theInterpolation)
@@ -410,12 +718,12 @@ Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
     case Linear:
     case Missing:
     {
-      MyLinearContourer::line(builder, *(itsPimple->itsData), theValue, *(itsPimple->itsHints));
+      MyLinearContourer::line(builder, *itsData, theValue, *itsHints);
       break;
     }
     case LogLinear:
     {
-      MyLogLinearContourer::line(builder, *(itsPimple->itsData), theValue, *(itsPimple->itsHints));
+      MyLogLinearContourer::line(builder, *itsData, theValue, *itsHints);
       break;
     }
     case Nearest:
@@ -433,14 +741,720 @@ Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
 
   Imagine::NFmiPath path;
   add_path(path, geom.get());
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ *\brief Destructor
+ */
+// ----------------------------------------------------------------------
 
-  path.InvGrid(theData.Grid());
+ContourCalculator::~ContourCalculator() {}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
 
-  if (itsPimple->isCacheOn)
-    itsPimple->itsLineCache.insert(path, theValue, kFloatMissing, theTime, theData);
+ContourCalculator::ContourCalculator()
+{
+  itsPimple.reset(new ContourCalculatorPimple());
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clear the cache
+ */
+// ----------------------------------------------------------------------
 
-  itsPimple->itWasCached = false;
-  return path;
+void ContourCalculator::clearCache()
+{
+  itsPimple->itsCache.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the cache on or off
+ *
+ * \param theFlag True if cache is to be set on
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cache(bool theFlag)
+{
+  itsPimple->isCacheOn = theFlag;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the directory of the persistent contour cache
+ *
+ * \param theDirectory The directory, an empty name disables the disk cache
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cacheDirectory(const std::string &theDirectory)
+{
+  itsPimple->itsDiskCache.directory(theDirectory);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum size of the persistent contour cache
+ *
+ * \param theBytes The maximum size of the cache directory, 0 for no limit
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cacheMaxDiskBytes(std::uint64_t theBytes)
+{
+  itsPimple->itsDiskCache.maxBytes(theBytes);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the memory budget of the cache
+ *
+ * \param theBytes The maximum approximate size of cached contours, 0 for no limit
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cacheMaxBytes(std::size_t theBytes)
+{
+  itsPimple->itsCache.maxBytes(theBytes);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of contours evicted from the cache so far
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ContourCalculator::cacheEvictions() const
+{
+  return itsPimple->itsCache.evictions();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of contours which could not be written into the disk cache
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ContourCalculator::cacheWriteErrors() const
+{
+  return itsPimple->itsDiskCacheErrors;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the approximate size of the cached contours
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ContourCalculator::cacheBytes() const
+{
+  return itsPimple->itsCache.bytes();
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the number of threads used for batch contouring
+ *
+ * \param theCount The number of threads, 1 implies sequential contouring
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::threads(unsigned int theCount)
+{
+  itsPimple->itsThreadCount = std::max(theCount, 1U);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return whether the last contour was cached
+ *
+ * \return True, if last returned contour was cached
+ */
+// ----------------------------------------------------------------------
+
+bool ContourCalculator::wasCached() const
+{
+  return itsPimple->itWasCached;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return where each contour of the latest batch was found from
+ *
+ * \return The states in the same order as the requested contours
+ */
+// ----------------------------------------------------------------------
+
+const ContourCalculator::CacheStates &ContourCalculator::cacheStates() const
+{
+  return itsPimple->itsCacheStates;
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set new active data on
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::data(const NFmiDataMatrix<float> &theData)
+{
+  itsPimple->itsGrid.reset(new DataMatrixAdapter(theData));
+  itsPimple->itsData = itsPimple->itsGrid;
+  itsPimple->itsValueHashOK = false;
+  itsPimple->itsHintsOK = false;
+  itsPimple->itsExtremaOK = false;
+  itsPimple->itsTilesOK = false;
+  itsPimple->itsWindow.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Restrict contouring to a window of the active data
+ *
+ * The window is given as inclusive grid index limits. Contours
+ * calculated for a window are cached separately from contours
+ * calculated for the full grid.
+ *
+ * \param theI1 The first column
+ * \param theJ1 The first row
+ * \param theI2 The last column
+ * \param theJ2 The last row
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::window(std::size_t theI1,
+                               std::size_t theJ1,
+                               std::size_t theI2,
+                               std::size_t theJ2)
+{
+  if (itsPimple->itsGrid.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before setting window");
+
+  const std::size_t nx = itsPimple->itsGrid->width();
+  const std::size_t ny = itsPimple->itsGrid->height();
+
+  if (theI1 >= theI2 || theJ1 >= theJ2 || theI2 >= nx || theJ2 >= ny)
+    throw std::runtime_error("ContourCalculator:: Invalid grid window");
+
+  itsPimple->itsData.reset(new DataMatrixAdapter(
+      *itsPimple->itsGrid, theI1, theJ1, theI2 - theI1 + 1, theJ2 - theJ1 + 1));
+  itsPimple->itsHintsOK = false;
+  itsPimple->itsExtremaOK = false;
+  itsPimple->itsTilesOK = false;
+
+  if (theI1 == 0 && theJ1 == 0 && theI2 == nx - 1 && theJ2 == ny - 1)
+    itsPimple->itsWindow.clear();
+  else
+  {
+    std::ostringstream out;
+    out << theI1 << ',' << theJ1 << ',' << theI2 << ',' << theJ2;
+    itsPimple->itsWindow = out.str();
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the tile size for fill contours
+ *
+ * Large grids are split into tiles of the given size, which
+ * are contoured independently and then merged. The result is
+ * equivalent to contouring the full grid at once.
+ *
+ * \param theSize The tile width and height in grid cells, 0 disables tiling
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::tileSize(std::size_t theSize)
+{
+  itsPimple->itsTileSize = theSize;
+  itsPimple->itsTilesOK = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the settings of another calculator
+ *
+ * The cache settings, thread count and tile size are copied. The
+ * data and the cached contours are not, each calculator keeps its own.
+ *
+ * \param theOther The calculator whose settings are copied
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::settings(const ContourCalculator &theOther)
+{
+  const ContourCalculatorPimple &other = *theOther.itsPimple;
+
+  itsPimple->isCacheOn = other.isCacheOn;
+  itsPimple->itsCache.maxBytes(other.itsCache.maxBytes());
+  itsPimple->itsDiskCache.maxBytes(other.itsDiskCache.maxBytes());
+  itsPimple->itsDiskCache.directory(other.itsDiskCache.directory());
+  itsPimple->itsThreadCount = other.itsThreadCount;
+  tileSize(other.itsTileSize);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour
+ *
+ * The memory cache is searched first, then the disk cache if one
+ * has been set. The returned reference points to the cached path,
+ * or if caching is disabled to a path which remains valid only
+ * until the next call.
+ *
+ * \return The path object
+ */
+// ----------------------------------------------------------------------
+
+const Imagine::NFmiPath &ContourCalculator::contour(const LazyQueryData &theData,
+                                                    float theLoLimit,
+                                                    float theHiLimit,
+                                                    const NFmiTime &theTime,
+                                                    ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const bool usedisk = itsPimple->itsDiskCache.enabled();
+
+  ContourCache::Key key;
+  if (itsPimple->isCacheOn || usedisk)
+    key = ContourCache::key(theLoLimit, theHiLimit, theTime, theData, itsPimple->itsWindow);
+
+  if (itsPimple->isCacheOn)
+  {
+    if (const Imagine::NFmiPath *cached = itsPimple->itsCache.find(key))
+    {
+      itsPimple->itWasCached = true;
+      return *cached;
+    }
+  }
+
+  std::string diskkey;
+  if (usedisk)
+    diskkey = itsPimple->disk_key(key, theInterpolation, theData);
+
+  Imagine::NFmiPath &path = itsPimple->itsPath;
+
+  if (usedisk && itsPimple->itsDiskCache.find(diskkey, path))
+    itsPimple->itWasCached = true;
+  else
+  {
+    if (itsPimple->may_contain(theLoLimit, theHiLimit))
+      path = itsPimple->fill(theLoLimit, theHiLimit, theInterpolation, itsPimple->itsThreadCount);
+    else
+      path = Imagine::NFmiPath();
+
+    path.InvGrid(theData.Grid());
+
+    if (usedisk && !itsPimple->itsDiskCache.insert(diskkey, path))
+      ++itsPimple->itsDiskCacheErrors;
+
+    itsPimple->itWasCached = false;
+  }
+
+  if (itsPimple->isCacheOn)
+    return itsPimple->itsCache.insert(key, path);
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contours for a set of ranges
+ *
+ * All the ranges are classified against the data extrema, which
+ * are calculated only once for the active data. Ranges which cannot
+ * intersect the data are never passed on to the contourer. Each
+ * calculated contour is stored into the caches just as if it had been
+ * requested individually.
+ *
+ * The remaining ranges are contoured in parallel if more than one
+ * thread has been requested. The results are identical to sequential
+ * contouring since the ranges are independent of each other.
+ *
+ * wasCached() returns true afterwards only if all the contours
+ * were found from the caches, cacheStates() tells the state of
+ * each contour.
+ *
+ * \param theLimits The lower and upper limits of each range
+ * \return The paths in the same order as the limits
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contour(const LazyQueryData &theData,
+                                                          const Limits &theLimits,
+                                                          const NFmiTime &theTime,
+                                                          ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const bool usedisk = itsPimple->itsDiskCache.enabled();
+
+  std::vector<Imagine::NFmiPath> paths(theLimits.size());
+  std::vector<ContourCache::Key> keys(theLimits.size());
+  std::vector<std::string> diskkeys(theLimits.size());
+  CacheStates states(theLimits.size(), NotCached);
+  std::vector<Limits::size_type> work;
+
+  for (Limits::size_type i = 0; i < theLimits.size(); i++)
+  {
+    const float lolimit = theLimits[i].first;
+    const float hilimit = theLimits[i].second;
+
+    if (itsPimple->isCacheOn || usedisk)
+      keys[i] = ContourCache::key(lolimit, hilimit, theTime, theData, itsPimple->itsWindow);
+
+    if (itsPimple->isCacheOn)
+    {
+      if (const Imagine::NFmiPath *path = itsPimple->itsCache.find(keys[i]))
+      {
+        paths[i] = *path;
+        states[i] = MemoryCached;
+        continue;
+      }
+    }
+
+    if (usedisk)
+    {
+      diskkeys[i] = itsPimple->disk_key(keys[i], theInterpolation, theData);
+      if (itsPimple->itsDiskCache.find(diskkeys[i], paths[i]))
+      {
+        states[i] = DiskCached;
+        continue;
+      }
+    }
+
+    if (itsPimple->may_contain(lolimit, hilimit))
+      work.push_back(i);
+  }
+
+  // The hints are shared by all threads and must be ready beforehand.
+  // Tiled contours are parallelized over the tiles instead of ranges.
+
+  unsigned int rangethreads = itsPimple->itsThreadCount;
+  unsigned int tilethreads = 1;
+
+  if (!work.empty())
+  {
+    if (!itsPimple->tiled())
+      itsPimple->require_hints();
+    else
+    {
+      itsPimple->require_tiles();
+      std::swap(rangethreads, tilethreads);
+    }
+  }
+
+  ParallelTools::run(work.size(),
+                     rangethreads,
+                     [&](std::size_t k)
+                     {
+                       const Limits::size_type i = work[k];
+                       paths[i] = itsPimple->fill(
+                           theLimits[i].first, theLimits[i].second, theInterpolation, tilethreads);
+                     });
+
+  itsPimple->store(paths, keys, diskkeys, states, theData);
+  return paths;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour line
+ *
+ * The memory cache is searched first, then the disk cache if one
+ * has been set. The returned reference points to the cached path,
+ * or if caching is disabled to a path which remains valid only
+ * until the next call.
+ *
+ * \return The path object
+ */
+// ----------------------------------------------------------------------
+
+const Imagine::NFmiPath &ContourCalculator::contour(const LazyQueryData &theData,
+                                                    float theValue,
+                                                    const NFmiTime &theTime,
+                                                    ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const bool usedisk = itsPimple->itsDiskCache.enabled();
+
+  ContourCache::Key key;
+  if (itsPimple->isCacheOn || usedisk)
+  {
+    key = ContourCache::key(theValue, kFloatMissing, theTime, theData, itsPimple->itsWindow);
+    key.isoline = true;
+  }
+
+  if (itsPimple->isCacheOn)
+  {
+    if (const Imagine::NFmiPath *cached = itsPimple->itsCache.find(key))
+    {
+      itsPimple->itWasCached = true;
+      return *cached;
+    }
+  }
+
+  std::string diskkey;
+  if (usedisk)
+    diskkey = itsPimple->disk_key(key, theInterpolation, theData);
+
+  Imagine::NFmiPath &path = itsPimple->itsPath;
+
+  if (usedisk && itsPimple->itsDiskCache.find(diskkey, path))
+    itsPimple->itWasCached = true;
+  else
+  {
+    path = itsPimple->line(theValue, theInterpolation);
+
+    path.InvGrid(theData.Grid());
+
+    if (usedisk && !itsPimple->itsDiskCache.insert(diskkey, path))
+      ++itsPimple->itsDiskCacheErrors;
+
+    itsPimple->itWasCached = false;
+  }
+
+  if (itsPimple->isCacheOn)
+    return itsPimple->itsCache.insert(key, path);
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour lines for a set of values
+ *
+ * The lines are contoured in parallel if more than one thread
+ * has been requested, and are cached individually.
+ *
+ * wasCached() returns true afterwards only if all the contours
+ * were found from the caches, cacheStates() tells the state of
+ * each contour.
+ *
+ * \param theValues The isoline values
+ * \return The paths in the same order as the values
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contour(const LazyQueryData &theData,
+                                                          const Values &theValues,
+                                                          const NFmiTime &theTime,
+                                                          ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const bool usedisk = itsPimple->itsDiskCache.enabled();
+
+  std::vector<Imagine::NFmiPath> paths(theValues.size());
+  std::vector<ContourCache::Key> keys(theValues.size());
+  std::vector<std::string> diskkeys(theValues.size());
+  CacheStates states(theValues.size(), NotCached);
+  std::vector<Values::size_type> work;
+
+  for (Values::size_type i = 0; i < theValues.size(); i++)
+  {
+    const float value = theValues[i];
+
+    if (itsPimple->isCacheOn || usedisk)
+    {
+      keys[i] = ContourCache::key(value, kFloatMissing, theTime, theData, itsPimple->itsWindow);
+      keys[i].isoline = true;
+    }
+
+    if (itsPimple->isCacheOn)
+    {
+      if (const Imagine::NFmiPath *path = itsPimple->itsCache.find(keys[i]))
+      {
+        paths[i] = *path;
+        states[i] = MemoryCached;
+        continue;
+      }
+    }
+
+    if (usedisk)
+    {
+      diskkeys[i] = itsPimple->disk_key(keys[i], theInterpolation, theData);
+      if (itsPimple->itsDiskCache.find(diskkeys[i], paths[i]))
+      {
+        states[i] = DiskCached;
+        continue;
+      }
+    }
+
+    work.push_back(i);
+  }
+
+  if (!work.empty())
+    itsPimple->require_hints();
+
+  ParallelTools::run(work.size(),
+                     itsPimple->itsThreadCount,
+                     [&](std::size_t k)
+                     {
+                       const Values::size_type i = work[k];
+                       paths[i] = itsPimple->line(theValues[i], theInterpolation);
+                     });
+
+  itsPimple->store(paths, keys, diskkeys, states, theData);
+  return paths;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contours projected onto an area
+ *
+ * The projected paths are cached separately from the unprojected
+ * ones, keyed by the fingerprint of the area. Repeated requests
+ * for the same projection hence need no projection at all. Only
+ * the ranges missing from the projected cache are requested from
+ * the unprojected level. Projected contours found from the cache
+ * are reported as memory cached by cacheStates().
+ *
+ * \param theLimits The lower and upper limits of each range
+ * \param theArea The area to project onto
+ * \return The projected paths in the same order as the limits
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contour(const LazyQueryData &theData,
+                                                          const Limits &theLimits,
+                                                          const NFmiTime &theTime,
+                                                          ContourInterpolation theInterpolation,
+                                                          const NFmiArea &theArea)
+{
+  std::vector<Imagine::NFmiPath> paths(theLimits.size());
+  std::vector<ContourCache::Key> keys(theLimits.size());
+  CacheStates states(theLimits.size(), MemoryCached);
+  std::vector<Limits::size_type> positions;
+  Limits missing;
+
+  const std::string area = (itsPimple->isCacheOn ? AreaTools::fingerprint(theArea) : "");
+
+  for (Limits::size_type i = 0; i < theLimits.size(); i++)
+  {
+    if (itsPimple->isCacheOn)
+    {
+      keys[i] = ContourCache::key(
+          theLimits[i].first, theLimits[i].second, theTime, theData, itsPimple->itsWindow);
+      keys[i].area = area;
+      if (const Imagine::NFmiPath *path = itsPimple->itsCache.find(keys[i]))
+      {
+        paths[i] = *path;
+        continue;
+      }
+    }
+    positions.push_back(i);
+    missing.push_back(theLimits[i]);
+  }
+
+  if (missing.empty())
+  {
+    itsPimple->itWasCached = true;
+    itsPimple->itsCacheStates = states;
+    return paths;
+  }
+
+  const std::vector<Imagine::NFmiPath> unprojected =
+      contour(theData, missing, theTime, theInterpolation);
+
+  for (Limits::size_type k = 0; k < positions.size(); k++)
+  {
+    const Limits::size_type i = positions[k];
+    states[i] = itsPimple->itsCacheStates[k];
+    paths[i] = unprojected[k];
+    paths[i].Project(&theArea);
+
+    if (itsPimple->isCacheOn && itsPimple->itsCache.find(keys[i]) == nullptr)
+      itsPimple->itsCache.insert(keys[i], paths[i]);
+  }
+
+  itsPimple->itsCacheStates = states;
+  return paths;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour lines projected onto an area
+ *
+ * The projected and optionally simplified paths are cached
+ * separately from the unprojected ones, keyed by the fingerprint
+ * of the area and the simplification tolerance. Projected contours
+ * found from the cache are reported as memory cached by cacheStates().
+ *
+ * \param theValues The isoline values
+ * \param theArea The area to project onto
+ * \param theSimplify The SimplifyLines tolerance in pixels, 0 for none
+ * \return The projected paths in the same order as the values
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contour(const LazyQueryData &theData,
+                                                          const Values &theValues,
+                                                          const NFmiTime &theTime,
+                                                          ContourInterpolation theInterpolation,
+                                                          const NFmiArea &theArea,
+                                                          float theSimplify)
+{
+  std::vector<Imagine::NFmiPath> paths(theValues.size());
+  std::vector<ContourCache::Key> keys(theValues.size());
+  CacheStates states(theValues.size(), MemoryCached);
+  std::vector<Values::size_type> positions;
+  Values missing;
+
+  const std::string area = (itsPimple->isCacheOn ? AreaTools::fingerprint(theArea) : "");
+
+  for (Values::size_type i = 0; i < theValues.size(); i++)
+  {
+    if (itsPimple->isCacheOn)
+    {
+      keys[i] =
+          ContourCache::key(theValues[i], kFloatMissing, theTime, theData, itsPimple->itsWindow);
+      keys[i].isoline = true;
+      keys[i].area = area;
+      keys[i].simplify = theSimplify;
+      if (const Imagine::NFmiPath *path = itsPimple->itsCache.find(keys[i]))
+      {
+        paths[i] = *path;
+        continue;
+      }
+    }
+    positions.push_back(i);
+    missing.push_back(theValues[i]);
+  }
+
+  if (missing.empty())
+  {
+    itsPimple->itWasCached = true;
+    itsPimple->itsCacheStates = states;
+    return paths;
+  }
+
+  const std::vector<Imagine::NFmiPath> unprojected =
+      contour(theData, missing, theTime, theInterpolation);
+
+  for (Values::size_type k = 0; k < positions.size(); k++)
+  {
+    const Values::size_type i = positions[k];
+    states[i] = itsPimple->itsCacheStates[k];
+    paths[i] = unprojected[k];
+    paths[i].Project(&theArea);
+    if (theSimplify > 0)
+      paths[i].SimplifyLines(theSimplify);
+
+    if (itsPimple->isCacheOn && itsPimple->itsCache.find(keys[i]) == nullptr)
+      itsPimple->itsCache.insert(keys[i], paths[i]);
+  }
+
+  itsPimple->itsCacheStates = states;
+  return paths;
 }
 
 // ======================================================================
@@ -0,0 +1,403 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class ContourDiskCache
+ */
+// ======================================================================
+
+#include "ContourDiskCache.h"
+#include "LazyQueryData.h"
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <newbase/NFmiFileSystem.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+const char magic[8] = {'Q', 'D', 'C', 'C', 'A', 'C', 'H', 'E'};
+const std::uint32_t version = 3;
+
+const std::uint64_t fnv_offset = 14695981039346656037ULL;
+const std::uint64_t fnv_prime = 1099511628211ULL;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief FNV-1a hash of a block of memory
+ */
+// ----------------------------------------------------------------------
+
+std::uint64_t fnv1a(const void *theData, std::size_t theSize, std::uint64_t theSeed)
+{
+  const unsigned char *ptr = static_cast<const unsigned char *>(theData);
+  std::uint64_t hash = theSeed;
+  for (std::size_t i = 0; i < theSize; i++)
+  {
+    hash ^= ptr[i];
+    hash *= fnv_prime;
+  }
+  return hash;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append the raw bytes of a value into a buffer
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+void append(std::string &theBuffer, const T &theValue)
+{
+  theBuffer.append(reinterpret_cast<const char *>(&theValue), sizeof(T));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Round a size up to a multiple of 8
+ */
+// ----------------------------------------------------------------------
+
+std::size_t padded(std::size_t theSize) { return (theSize + 7) & ~static_cast<std::size_t>(7); }
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
+
+ContourDiskCache::ContourDiskCache() : itsDirectory(), itsMaxBytes(0), itsWrittenBytes(0) {}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the cache directory
+ *
+ * The directory is created if necessary. An empty name disables
+ * the cache.
+ *
+ * \param theDirectory The directory name
+ */
+// ----------------------------------------------------------------------
+
+void ContourDiskCache::directory(const std::string &theDirectory)
+{
+  if (!theDirectory.empty() && !NFmiFileSystem::DirectoryExists(theDirectory))
+    if (!NFmiFileSystem::CreateDirectory(theDirectory))
+      throw runtime_error("Failed to create contour cache directory '" + theDirectory + "'");
+
+  itsDirectory = theDirectory;
+  itsWrittenBytes = itsMaxBytes;  // check the size on the next insert
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum size of the cache directory
+ *
+ * The limit is shared by all processes using the same directory,
+ * and is enforced by removing the oldest files whenever a tenth of
+ * the limit has been written since the previous check.
+ *
+ * \param theBytes The maximum combined size of the files, 0 for no limit
+ */
+// ----------------------------------------------------------------------
+
+void ContourDiskCache::maxBytes(std::uint64_t theBytes)
+{
+  itsMaxBytes = theBytes;
+  itsWrittenBytes = theBytes;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the persistent key for a contour
+ *
+ * \param theKey The in-memory key of the contour
+ * The tile size is part of the key since tiled contours cover the
+ * same area as untiled ones, but consist of different vertices.
+ *
+ * \param theInterpolation The contouring interpolation method
+ * \param theData The query data
+ * \param theValueHash The hash of the contoured values
+ * \param theTileSize The tile size used in contouring, 0 if not tiled
+ * \return The key as a binary string
+ */
+// ----------------------------------------------------------------------
+
+std::string ContourDiskCache::key(const ContourCache::Key &theKey,
+                                  ContourInterpolation theInterpolation,
+                                  const LazyQueryData &theData,
+                                  std::uint64_t theValueHash,
+                                  std::uint64_t theTileSize)
+{
+  const std::int64_t filesize = NFmiFileSystem::FileSize(theData.Filename());
+  const std::int64_t mtime = NFmiFileSystem::FileModificationTime(theData.Filename());
+
+  std::string buffer;
+  append(buffer, filesize);
+  append(buffer, mtime);
+  append(buffer, static_cast<std::int64_t>(theKey.origintime));
+  append(buffer, static_cast<std::int64_t>(theKey.time));
+  append(buffer, static_cast<std::uint64_t>(theKey.param));
+  append(buffer, theKey.level);
+  append(buffer, theKey.lolimit);
+  append(buffer, theKey.hilimit);
+  append(buffer, static_cast<std::int32_t>(theKey.isoline));
+  append(buffer, static_cast<std::int32_t>(theInterpolation));
+  append(buffer, theValueHash);
+  append(buffer, theTileSize);
+  buffer += theKey.window;
+  return buffer;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hash a block of data values
+ *
+ * The values are hashed a word at a time instead of a byte at a
+ * time, since the full grid is hashed whenever new data has to be
+ * looked up from the disk.
+ *
+ * \param theValues The values
+ * \param theCount The number of values
+ * \param theSeed The hash of any previous blocks, or 0
+ * \return The combined hash
+ */
+// ----------------------------------------------------------------------
+
+std::uint64_t ContourDiskCache::hash(const float *theValues,
+                                     std::size_t theCount,
+                                     std::uint64_t theSeed)
+{
+  std::uint64_t hash = (theSeed == 0 ? fnv_offset : theSeed);
+  for (std::size_t i = 0; i < theCount; i++)
+  {
+    std::uint32_t word;
+    memcpy(&word, theValues + i, sizeof(word));
+    hash ^= word;
+    hash *= fnv_prime;
+  }
+  return hash;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the cache file name for the given key
+ */
+// ----------------------------------------------------------------------
+
+std::string ContourDiskCache::filename(const std::string &theKey) const
+{
+  ostringstream out;
+  out << itsDirectory << '/' << hex << fnv1a(theKey.data(), theKey.size(), fnv_offset) << ".qdc";
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fetch a contour from the cache
+ *
+ * Missing, truncated or otherwise invalid files are treated as
+ * cache misses.
+ *
+ * \param theKey The key from key()
+ * \param thePath The path to be filled
+ * \return True if the contour was found
+ */
+// ----------------------------------------------------------------------
+
+bool ContourDiskCache::find(const std::string &theKey, Imagine::NFmiPath &thePath) const
+{
+  const std::string file = filename(theKey);
+
+  if (!NFmiFileSystem::FileExists(file))
+    return false;
+
+  boost::iostreams::mapped_file_source source;
+  try
+  {
+    source.open(file);
+  }
+  catch (...)
+  {
+    return false;
+  }
+
+  const char *data = source.data();
+  const std::size_t size = source.size();
+
+  const std::size_t keypos = sizeof(magic) + 2 * sizeof(std::uint32_t);
+  if (size < keypos)
+    return false;
+
+  std::uint32_t fileversion, keysize;
+  memcpy(&fileversion, data + sizeof(magic), sizeof(fileversion));
+  memcpy(&keysize, data + sizeof(magic) + sizeof(fileversion), sizeof(keysize));
+
+  if (memcmp(data, magic, sizeof(magic)) != 0 || fileversion != version ||
+      keysize != theKey.size())
+    return false;
+
+  const std::size_t countpos = keypos + padded(keysize);
+  if (size < countpos + sizeof(std::uint64_t) || memcmp(data + keypos, theKey.data(), keysize) != 0)
+    return false;
+
+  std::uint64_t count;
+  memcpy(&count, data + countpos, sizeof(count));
+
+  const std::size_t oppos = countpos + sizeof(count);
+  const std::size_t xypos = oppos + padded(count);
+  if (size != xypos + 2 * count * sizeof(double))
+    return false;
+
+  const unsigned char *ops = reinterpret_cast<const unsigned char *>(data + oppos);
+  const char *xy = data + xypos;
+
+  Imagine::NFmiPath path;
+  for (std::uint64_t i = 0; i < count; i++)
+  {
+    double x, y;
+    memcpy(&x, xy + 2 * i * sizeof(double), sizeof(double));
+    memcpy(&y, xy + (2 * i + 1) * sizeof(double), sizeof(double));
+    path.Add(Imagine::NFmiPathElement(static_cast<Imagine::NFmiPathOperation>(ops[i]), x, y));
+  }
+
+  thePath = path;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store a contour into the cache
+ *
+ * Failing to store the contour is not an error, since the cache
+ * is optional. Any partially written file is removed.
+ *
+ * \param theKey The key from key()
+ * \param thePath The path to store
+ * \return False if the contour could not be stored
+ */
+// ----------------------------------------------------------------------
+
+bool ContourDiskCache::insert(const std::string &theKey, const Imagine::NFmiPath &thePath)
+{
+  const Imagine::NFmiPathData &elements = thePath.Elements();
+  const std::uint64_t count = elements.size();
+  const std::uint32_t keysize = theKey.size();
+
+  std::string buffer;
+  buffer.reserve(sizeof(magic) + 8 + padded(keysize) + 8 + padded(count) + 16 * count);
+
+  buffer.append(magic, sizeof(magic));
+  append(buffer, version);
+  append(buffer, keysize);
+  buffer += theKey;
+  buffer.resize(padded(buffer.size()), '\0');
+  append(buffer, count);
+
+  for (Imagine::NFmiPathData::const_iterator it = elements.begin(); it != elements.end(); ++it)
+    buffer += static_cast<char>(it->op);
+  buffer.resize(padded(buffer.size()), '\0');
+
+  for (Imagine::NFmiPathData::const_iterator it = elements.begin(); it != elements.end(); ++it)
+  {
+    append(buffer, static_cast<double>(it->x));
+    append(buffer, static_cast<double>(it->y));
+  }
+
+  const std::string file = filename(theKey);
+
+  ostringstream tmpname;
+  tmpname << file << ".tmp" << getpid() << '_' << std::this_thread::get_id();
+  const std::string tmpfile = tmpname.str();
+
+  bool ok;
+  {
+    ofstream out(tmpfile.c_str(), ios::out | ios::binary);
+    out.write(buffer.data(), buffer.size());
+    out.close();
+    ok = !out.fail();
+  }
+
+  if (!ok || std::rename(tmpfile.c_str(), file.c_str()) != 0)
+  {
+    std::remove(tmpfile.c_str());
+    return false;
+  }
+
+  itsWrittenBytes += buffer.size();
+  if (itsMaxBytes > 0 && itsWrittenBytes >= itsMaxBytes / 10)
+  {
+    itsWrittenBytes = 0;
+    cleanup();
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove the oldest files until the cache is within its size limit
+ *
+ * Files which cannot be removed, for example since another process
+ * just removed them, are ignored.
+ */
+// ----------------------------------------------------------------------
+
+void ContourDiskCache::cleanup() const
+{
+  struct CacheFile
+  {
+    time_t mtime;
+    std::uint64_t size;
+    std::string name;
+
+    bool operator<(const CacheFile &theOther) const { return mtime < theOther.mtime; }
+  };
+
+  DIR *dir = opendir(itsDirectory.c_str());
+  if (dir == nullptr)
+    return;
+
+  std::vector<CacheFile> files;
+  std::uint64_t total = 0;
+
+  while (const struct dirent *entry = readdir(dir))
+  {
+    const std::string name = entry->d_name;
+    if (name.size() < 4 || name.compare(name.size() - 4, 4, ".qdc") != 0)
+      continue;
+
+    const std::string path = itsDirectory + '/' + name;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+      continue;
+
+    CacheFile file = {info.st_mtime, static_cast<std::uint64_t>(info.st_size), path};
+    files.push_back(file);
+    total += file.size;
+  }
+  closedir(dir);
+
+  if (total <= itsMaxBytes)
+    return;
+
+  std::sort(files.begin(), files.end());
+  for (std::size_t i = 0; i < files.size() && total > itsMaxBytes; i++)
+  {
+    std::remove(files[i].name.c_str());
+    total -= files[i].size;
+  }
+}
+
+// ======================================================================
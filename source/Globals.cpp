@@ -41,6 +41,7 @@ using namespace std;
 Globals::Globals()
     : verbose(false),
       force(false),
+      threads(1),
       cmdline_querydata(),
       cmdline_files(),
       datapath(Optional<string>("qdcontour::querydata_path", ".")),
@@ -60,10 +61,14 @@ Globals::Globals()
       jpegquality(-1),
       savealpha(true),
       reducecolors(false),
+      knownpalette(false),
+      palette(),
       wantpalette(false),
       forcepalette(false),
       contourinterpolation("Linear"),
       contourtriangles(1),
+      contourviewport(false),
+      contourviewportmargin(2),
       smoother("None"),
       smootherradius(1),
       smootherfactor(1),
@@ -105,6 +110,9 @@ Globals::Globals()
       arrowpoints(),
       queryfilelist(),
       queryfilenames(),
+      slicecache(0),
+      prefetch(false),
+      imagethreads(1),
       queryinfo(),
       querydatalevel(-1),
       timesteps(24),
@@ -138,8 +146,11 @@ Globals::Globals()
       imagelocator(),
       calculator(),
       maskcalculator(),
+      imagecalculators(),
       maskqueryinfo(),
       querystreams(),
+      querypool(),
+      querystreamindex(),
       shapespecs(),
       specs(),
       unitsconverter(),
@@ -153,7 +164,9 @@ Globals::Globals()
       graticulelat2(),
       graticuledx(),
       graticuledy(),
-      timestampformat(kYYYYMMDDHHMM)
+      timestampformat(kYYYYMMDDHHMM),
+      imagepool(),
+      imagewriter()
 {
   symbollocator.minDistanceToDifferentParameter(8);
   symbollocator.minDistanceToDifferentValue(8);
@@ -17,7 +17,11 @@ using namespace std;
  */
 // ----------------------------------------------------------------------
 
-void ImageCache::clear() const { itsCache.clear(); }
+void ImageCache::clear() const
+{
+  lock_guard<mutex> lock(itsMutex);
+  itsCache.clear();
+}
 // ----------------------------------------------------------------------
 /*!
  * \brief Find image from cache (or read it if necessary)
@@ -26,6 +30,8 @@ void ImageCache::clear() const { itsCache.clear(); }
 
 const ImagineXr_or_NFmiImage &ImageCache::getImage(const string &theFile) const
 {
+  lock_guard<mutex> lock(itsMutex);
+
   storage_type::const_iterator it = itsCache.find(theFile);
   if (it != itsCache.end()) return it->second;
 
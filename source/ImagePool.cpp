@@ -0,0 +1,90 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class ImagePool
+ */
+// ======================================================================
+
+#include "ImagePool.h"
+
+using namespace std;
+using Imagine::NFmiImage;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
+
+ImagePool::ImagePool() : itsWidth(0), itsHeight(0), itsImages(), itsMutex() {}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get an image of the given size
+ *
+ * An unused image is recycled if possible. The image is returned
+ * to the pool once it is no longer referenced.
+ *
+ * \param theWidth The width of the image
+ * \param theHeight The height of the image
+ * \return The image, with undefined contents
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<NFmiImage> ImagePool::get(int theWidth, int theHeight)
+{
+  NFmiImage *image = 0;
+  {
+    lock_guard<mutex> lock(itsMutex);
+
+    if (theWidth != itsWidth || theHeight != itsHeight)
+    {
+      itsImages.clear();
+      itsWidth = theWidth;
+      itsHeight = theHeight;
+    }
+
+    if (!itsImages.empty())
+    {
+      image = itsImages.back().release();
+      itsImages.pop_back();
+    }
+  }
+
+  if (image == 0)
+    image = new NFmiImage(theWidth, theHeight);
+
+  return std::shared_ptr<NFmiImage>(image, [this](NFmiImage *theImage) { release(theImage); });
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Release all unused images
+ *
+ * Images still in use are returned to the pool as usual.
+ */
+// ----------------------------------------------------------------------
+
+void ImagePool::clear()
+{
+  lock_guard<mutex> lock(itsMutex);
+  itsImages.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return an image to the pool
+ *
+ * Images of any other size than the one last requested are deleted.
+ */
+// ----------------------------------------------------------------------
+
+void ImagePool::release(NFmiImage *theImage)
+{
+  std::unique_ptr<NFmiImage> image(theImage);
+
+  lock_guard<mutex> lock(itsMutex);
+  if (image->Width() == itsWidth && image->Height() == itsHeight)
+    itsImages.push_back(std::move(image));
+}
+
+// ======================================================================
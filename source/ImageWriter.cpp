@@ -0,0 +1,235 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class ImageWriter
+ */
+// ======================================================================
+
+#include "ImageWriter.h"
+
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ *
+ * By default there are no threads, and images are written immediately.
+ */
+// ----------------------------------------------------------------------
+
+ImageWriter::ImageWriter()
+    : itsThreads(),
+      itsQueue(),
+      itsPending(),
+      itsQueueSize(2),
+      itsActive(0),
+      itIsStopping(false),
+      itsErrors()
+{
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Destructor
+ *
+ * The destructor is reached with images pending only if the program
+ * failed before waiting for them. The rendered images are written
+ * anyway, and any errors are reported since they cannot be thrown.
+ */
+// ----------------------------------------------------------------------
+
+ImageWriter::~ImageWriter()
+{
+  try
+  {
+    wait();
+  }
+  catch (const std::exception &e)
+  {
+    cerr << "Error: " << e.what() << endl;
+  }
+  stop();
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the number of writer threads
+ *
+ * Any queued images are written first.
+ *
+ * \param theCount The number of threads, 0 for writing immediately
+ */
+// ----------------------------------------------------------------------
+
+void ImageWriter::threads(unsigned int theCount)
+{
+  wait();
+  stop();
+
+  itIsStopping = false;
+  for (unsigned int i = 0; i < theCount; i++)
+    itsThreads.emplace_back(&ImageWriter::work, this);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of writer threads
+ */
+// ----------------------------------------------------------------------
+
+unsigned int ImageWriter::threads() const { return static_cast<unsigned int>(itsThreads.size()); }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum number of images waiting to be written
+ *
+ * \param theSize The maximum number of queued images
+ */
+// ----------------------------------------------------------------------
+
+void ImageWriter::queueSize(std::size_t theSize)
+{
+  if (theSize < 1)
+    throw runtime_error("ImageWriter: the queue size must be positive");
+
+  lock_guard<mutex> lock(itsMutex);
+  itsQueueSize = theSize;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write an image
+ *
+ * Blocks while the queue is full.
+ *
+ * \param theFile The name of the file being written
+ * \param theTask The task which writes the file
+ */
+// ----------------------------------------------------------------------
+
+void ImageWriter::write(const string &theFile, const Task &theTask)
+{
+  if (itsThreads.empty())
+  {
+    theTask();
+    return;
+  }
+
+  unique_lock<mutex> lock(itsMutex);
+  itsWorkDone.wait(lock, [this] { return itsQueue.size() < itsQueueSize; });
+
+  itsQueue.push_back(Job(theFile, theTask));
+  itsPending.insert(theFile);
+  itsWorkAvailable.notify_one();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test if the file is queued or being written
+ *
+ * \param theFile The name of the file
+ * \return True if the file will be written
+ */
+// ----------------------------------------------------------------------
+
+bool ImageWriter::pending(const string &theFile) const
+{
+  lock_guard<mutex> lock(itsMutex);
+  return (itsPending.find(theFile) != itsPending.end());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for all queued images to be written
+ *
+ * Throws if any of the images could not be written. All the errors
+ * are reported, and are forgotten once reported.
+ */
+// ----------------------------------------------------------------------
+
+void ImageWriter::wait()
+{
+  unique_lock<mutex> lock(itsMutex);
+  itsWorkDone.wait(lock, [this] { return itsQueue.empty() && itsActive == 0; });
+
+  if (itsErrors.empty())
+    return;
+
+  string msg = itsErrors.front();
+  for (std::size_t i = 1; i < itsErrors.size(); i++)
+    msg += "\n--> " + itsErrors[i];
+  itsErrors.clear();
+
+  throw runtime_error(msg);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Stop the writer threads, discarding any queued images
+ */
+// ----------------------------------------------------------------------
+
+void ImageWriter::stop()
+{
+  {
+    lock_guard<mutex> lock(itsMutex);
+    itIsStopping = true;
+    for (list<Job>::const_iterator it = itsQueue.begin(); it != itsQueue.end(); ++it)
+      itsPending.erase(itsPending.find(it->first));
+    itsQueue.clear();
+  }
+  itsWorkAvailable.notify_all();
+  itsWorkDone.notify_all();
+
+  for (std::size_t i = 0; i < itsThreads.size(); i++)
+    itsThreads[i].join();
+  itsThreads.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the queued images until stopped
+ */
+// ----------------------------------------------------------------------
+
+void ImageWriter::work()
+{
+  unique_lock<mutex> lock(itsMutex);
+  for (;;)
+  {
+    itsWorkAvailable.wait(lock, [this] { return itIsStopping || !itsQueue.empty(); });
+    if (itIsStopping)
+      return;
+
+    Job job = itsQueue.front();
+    itsQueue.pop_front();
+    ++itsActive;
+    itsWorkDone.notify_all();  // there is room in the queue
+
+    lock.unlock();
+    string error;
+    try
+    {
+      job.second();
+    }
+    catch (const std::exception &e)
+    {
+      error = e.what();
+    }
+    catch (...)
+    {
+      error = "Unknown error while writing '" + job.first + "'";
+    }
+    lock.lock();
+
+    if (!error.empty())
+      itsErrors.push_back(error);
+    itsPending.erase(itsPending.find(job.first));
+    --itsActive;
+    itsWorkDone.notify_all();
+  }
+}
+
+// ======================================================================
@@ -46,6 +46,14 @@
  *
  * If there is no bounding box, we simply choose the first one
  * available.
+ *
+ * Since the candidates are ranked by their distance to the labels
+ * of the previous timestep, candidates for the next timestep cannot
+ * be ranked before the labels of the current timestep have been
+ * chosen. A locator may hence be set to record the candidates
+ * instead, and the recorded candidates can later be replayed into
+ * the locator holding the previous labels. This enables collecting
+ * the candidates for several timesteps in parallel.
  */
 // ======================================================================
 
@@ -121,7 +129,9 @@ LabelLocator::LabelLocator()
       itsMinDistanceToDifferentParameter(30),
       itsActiveParameter(0),
       itsPreviousCoordinates(),
-      itsCurrentCoordinates()
+      itsCurrentCoordinates(),
+      itIsRecording(false),
+      itsRecording()
 {
 }
 
@@ -149,6 +159,7 @@ void LabelLocator::clear()
   itsActiveParameter = badparameter;
   itsPreviousCoordinates.clear();
   itsCurrentCoordinates.clear();
+  itsRecording.clear();
 }
 
 // ----------------------------------------------------------------------
@@ -321,6 +332,15 @@ void LabelLocator::add(float theContour, int theX, int theY)
   if (itsActiveParameter == badparameter)
     throw runtime_error("LabelLocator: Cannot add label location before setting the parameter");
 
+  // Only remember the candidate if it is to be ranked later
+
+  if (itIsRecording)
+  {
+    Candidate candidate = {itsActiveParameter, theContour, theX, theY};
+    itsRecording.push_back(candidate);
+    return;
+  }
+
   // Default constructed values are a desired side-effect in here
   // This is much simpler than using find + insert with checking
 
@@ -346,6 +366,47 @@ void LabelLocator::add(float theContour, int theX, int theY)
   c.insert(Coordinates::value_type(dist, XY(theX, theY)));
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set recording mode on or off
+ *
+ * In recording mode the added candidates are only remembered in
+ * the order they were added, the locator cannot choose any labels.
+ * Any earlier recorded candidates are discarded.
+ *
+ * \param theFlag True if the candidates are to be recorded
+ */
+// ----------------------------------------------------------------------
+
+void LabelLocator::record(bool theFlag)
+{
+  itIsRecording = theFlag;
+  itsRecording.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the candidates recorded by another locator
+ *
+ * The candidates are added in the original order, hence the
+ * result is identical to adding them directly to this locator.
+ * The active parameter is left to the last recorded one.
+ *
+ * \param theRecorder The locator which recorded the candidates
+ */
+// ----------------------------------------------------------------------
+
+void LabelLocator::replay(const LabelLocator &theRecorder)
+{
+  for (std::vector<Candidate>::const_iterator it = theRecorder.itsRecording.begin();
+       it != theRecorder.itsRecording.end();
+       ++it)
+  {
+    parameter(it->param);
+    add(it->contour, it->x, it->y);
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Calculate point distance to border
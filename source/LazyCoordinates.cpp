@@ -12,8 +12,8 @@
  */
 // ----------------------------------------------------------------------
 
-LazyCoordinates::LazyCoordinates(const NFmiArea &theArea)
-    : itsArea(theArea), itsInitialized(false), itsData()
+LazyCoordinates::LazyCoordinates(const NFmiArea &theArea, const LazyQueryData &theQueryData)
+    : itsArea(theArea), itsQueryData(theQueryData), itsInitialized(false), itsData()
 {
 }
 
@@ -6,6 +6,10 @@
 // ======================================================================
 
 #include "LazyQueryData.h"
+#include "AreaTools.h"
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
 #include <gis/CoordinateMatrix.h>
 #include <gis/CoordinateTransformation.h>
 #include <gis/SpatialReference.h>
@@ -13,13 +17,127 @@
 #include <newbase/NFmiFileSystem.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiInterpolation.h>
+#include <newbase/NFmiLevel.h>
 #include <newbase/NFmiQueryData.h>
+#include <algorithm>
 #include <fstream>
-#include <sstream>
+#include <functional>
 #include <stdexcept>
 
 using namespace std;
 
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Compare indexed times
+ */
+// ----------------------------------------------------------------------
+
+bool time_less(const pair<NFmiMetTime, unsigned long> &theEntry, const NFmiTime &theTime)
+{
+  return theEntry.first.IsLessThan(theTime);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Compare indexed levels
+ */
+// ----------------------------------------------------------------------
+
+bool level_less(const pair<float, unsigned long> &theEntry, float theLevel)
+{
+  return theEntry.first < theLevel;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The number of areas whose grid coordinates are cached
+ */
+// ----------------------------------------------------------------------
+
+const std::size_t max_cached_areas = 8;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Supported compression methods
+ */
+// ----------------------------------------------------------------------
+
+enum Compression
+{
+  Uncompressed,
+  Gzip,
+  Bzip2
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Recognize the compression of a file from its first bytes
+ *
+ * Directories and unreadable files are reported as uncompressed,
+ * newbase will then handle them as usual.
+ */
+// ----------------------------------------------------------------------
+
+Compression compression_type(const string &theFile)
+{
+  ifstream in(theFile.c_str(), ios::in | ios::binary);
+  if (!in)
+    return Uncompressed;
+
+  unsigned char magic[3] = {0, 0, 0};
+  in.read(reinterpret_cast<char *>(magic), sizeof(magic));
+  if (in.gcount() < 2)
+    return Uncompressed;
+
+  if (magic[0] == 0x1f && magic[1] == 0x8b)
+    return Gzip;
+  if (in.gcount() == 3 && magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h')
+    return Bzip2;
+  return Uncompressed;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read compressed querydata
+ *
+ * The data is decompressed while it is being parsed, no temporary
+ * files are needed. Truncated or corrupt files are errors.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<NFmiQueryData> read_compressed(const string &theFile, Compression theCompression)
+{
+  ifstream file(theFile.c_str(), ios::in | ios::binary);
+  if (!file)
+    throw runtime_error("Failed to open '" + theFile + "' for reading");
+
+  boost::iostreams::filtering_istream in;
+  if (theCompression == Gzip)
+    in.push(boost::iostreams::gzip_decompressor());
+  else
+    in.push(boost::iostreams::bzip2_decompressor());
+  in.push(file);
+
+  std::shared_ptr<NFmiQueryData> data(new NFmiQueryData());
+  try
+  {
+    in >> *data;
+  }
+  catch (const std::exception &e)
+  {
+    throw runtime_error("Failed to decompress querydata from '" + theFile + "': " + e.what());
+  }
+
+  if (in.fail())
+    throw runtime_error("Failed to decompress querydata from '" + theFile + "'");
+
+  return data;
+}
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Destructor
@@ -33,7 +151,10 @@ LazyQueryData::~LazyQueryData() {}
  */
 // ----------------------------------------------------------------------
 
-LazyQueryData::LazyQueryData() : itsInfo(), itsData() {}
+LazyQueryData::LazyQueryData()
+    : itsInfo(), itsData(), itsSliceCacheSize(0), itsSlices()
+{
+}
 // ----------------------------------------------------------------------
 /*!
  * \brief Return the parameter name
@@ -75,6 +196,15 @@ float LazyQueryData::GetLevelNumber() const
 /*!
  * \brief Lazy-read the given query data file
  *
+ * Only the header is parsed, the data section of a binary querydata
+ * file is memory mapped. Pages are hence read from disk only for the
+ * parameters, levels and times whose values are actually requested.
+ * Files in the old ASCII format cannot be mapped and are read fully.
+ *
+ * Files compressed with gzip or bzip2 are recognized by their
+ * contents, and are decompressed directly into memory. Such files
+ * cannot be mapped either, and are hence read fully too.
+ *
  * Throws if an error occurs.
  *
  * \param theDataFile The filename (or directory) to read
@@ -86,8 +216,81 @@ void LazyQueryData::Read(const std::string &theDataFile)
   itsInputName = theDataFile;
   itsDataFile = theDataFile;
 
-  itsData.reset(new NFmiQueryData(theDataFile));
+  itsSlices.clear();
+  itsLocations.reset();
+  itsLocationsWorldXY.clear();
+  itsLocationsXY.clear();
+
+  const Compression compression = compression_type(theDataFile);
+  if (compression != Uncompressed)
+    itsData = read_compressed(theDataFile, compression);
+  else
+  {
+    const bool memorymap = true;
+    itsData.reset(new NFmiQueryData(theDataFile, memorymap));
+  }
   itsInfo.reset(new NFmiFastQueryInfo(itsData.get()));
+
+  BuildIndex();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Index the times and levels of the data
+ *
+ * The indices are sorted by time and level value. Stable sorting
+ * keeps the first of any duplicate levels first, just like a
+ * linear search would find it.
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::BuildIndex()
+{
+  itsTimes.clear();
+  for (itsInfo->ResetTime(); itsInfo->NextTime();)
+    itsTimes.push_back(make_pair(itsInfo->ValidTime(), itsInfo->TimeIndex()));
+
+  stable_sort(itsTimes.begin(),
+              itsTimes.end(),
+              [](const SortedTimes::value_type &a, const SortedTimes::value_type &b)
+              { return a.first.IsLessThan(b.first); });
+
+  itsLevels.clear();
+  for (itsInfo->ResetLevel(); itsInfo->NextLevel();)
+    itsLevels.push_back(make_pair(itsInfo->Level()->LevelValue(), itsInfo->LevelIndex()));
+
+  stable_sort(itsLevels.begin(),
+              itsLevels.end(),
+              [](const SortedLevels::value_type &a, const SortedLevels::value_type &b)
+              { return a.first < b.first; });
+
+  itsInfo->ResetTime();
+  itsInfo->ResetLevel();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create an independent iterator over the same data
+ *
+ * The clone shares the data itself but has its own parameter,
+ * level and time position, coordinate caches and slice cache,
+ * and may hence be used in another thread.
+ *
+ * \return The clone
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<LazyQueryData> LazyQueryData::Clone() const
+{
+  std::shared_ptr<LazyQueryData> clone(new LazyQueryData());
+  clone->itsInputName = itsInputName;
+  clone->itsDataFile = itsDataFile;
+  clone->itsData = itsData;
+  clone->itsInfo.reset(new NFmiFastQueryInfo(itsData.get()));
+  clone->itsTimes = itsTimes;
+  clone->itsLevels = itsLevels;
+  clone->itsSliceCacheSize = itsSliceCacheSize;
+  return clone;
 }
 
 // ----------------------------------------------------------------------
@@ -180,6 +383,91 @@ bool LazyQueryData::PreviousTime()
 {
   return itsInfo->PreviousTime();
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the exact time
+ *
+ * The time is left unchanged if the data does not contain it.
+ *
+ * \param theTime The desired time
+ * \return True if the time was found
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::SetTime(const NFmiTime &theTime)
+{
+  SortedTimes::const_iterator it =
+      lower_bound(itsTimes.begin(), itsTimes.end(), theTime, time_less);
+  if (it == itsTimes.end() || !it->first.IsEqual(theTime))
+    return false;
+  return itsInfo->TimeIndex(it->second);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the first time at or after the given time
+ *
+ * The time is left unchanged if all times are before the given time.
+ *
+ * \param theTime The desired time
+ * \return True if a suitable time was found
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::SetTimeAtOrAfter(const NFmiTime &theTime)
+{
+  SortedTimes::const_iterator it =
+      lower_bound(itsTimes.begin(), itsTimes.end(), theTime, time_less);
+  if (it == itsTimes.end())
+    return false;
+  return itsInfo->TimeIndex(it->second);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the level with the given value
+ *
+ * The level is left unchanged if the data does not contain it.
+ *
+ * \param theLevel The desired level value
+ * \return True if the level was found
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::SetLevel(float theLevel)
+{
+  SortedLevels::const_iterator it =
+      lower_bound(itsLevels.begin(), itsLevels.end(), theLevel, level_less);
+  if (it == itsLevels.end() || it->first != theLevel)
+    return false;
+  return itsInfo->LevelIndex(it->second);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the index of the current level
+ */
+// ----------------------------------------------------------------------
+
+unsigned long LazyQueryData::LevelIndex() const
+{
+  return itsInfo->LevelIndex();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the level by its index
+ *
+ * \param theIndex The index as returned by LevelIndex()
+ * \return True if the index is valid
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::LevelIndex(unsigned long theIndex)
+{
+  return itsInfo->LevelIndex(theIndex);
+}
 // ----------------------------------------------------------------------
 /*!
  *
@@ -247,15 +535,17 @@ std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::Locations() const
 std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsWorldXY(
     const NFmiArea &theArea) const
 {
-  ostringstream os;
-  os << theArea;
+  AreaLocations entry;
+  entry.fingerprint = AreaTools::fingerprint(theArea);
+  entry.hash = std::hash<std::string>()(entry.fingerprint);
 
-  if (itsLocationsWorldXY.get() == 0 || os.str() != itsLocationsArea)
+  entry.locations = FindLocations(itsLocationsWorldXY, entry);
+  if (!entry.locations)
   {
-    itsLocationsArea = os.str();
-    itsLocationsWorldXY.reset(new Fmi::CoordinateMatrix(itsInfo->LocationsWorldXY(theArea)));
+    entry.locations.reset(new Fmi::CoordinateMatrix(itsInfo->LocationsWorldXY(theArea)));
+    InsertLocations(itsLocationsWorldXY, entry);
   }
-  return itsLocationsWorldXY;
+  return entry.locations;
 }
 
 // ----------------------------------------------------------------------
@@ -266,15 +556,62 @@ std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsWorldXY(
 
 std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsXY(const NFmiArea &theArea) const
 {
-  ostringstream os;
-  os << theArea;
+  AreaLocations entry;
+  entry.fingerprint = AreaTools::fingerprint(theArea);
+  entry.hash = std::hash<std::string>()(entry.fingerprint);
 
-  if (itsLocationsXY.get() == 0 || os.str() != itsLocationsArea)
+  entry.locations = FindLocations(itsLocationsXY, entry);
+  if (!entry.locations)
   {
-    itsLocationsArea = os.str();
-    itsLocationsXY.reset(new Fmi::CoordinateMatrix(itsInfo->LocationsXY(theArea)));
+    entry.locations.reset(new Fmi::CoordinateMatrix(itsInfo->LocationsXY(theArea)));
+    InsertLocations(itsLocationsXY, entry);
   }
-  return itsLocationsXY;
+  return entry.locations;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find cached grid coordinates for an area
+ *
+ * A found entry is marked as the most recently used one.
+ *
+ * \param theCache The cache to search
+ * \param theKey The hash and fingerprint of the area
+ * \return The coordinates, or an empty pointer if not found
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::FindLocations(LocationCache &theCache,
+                                                                    const AreaLocations &theKey)
+{
+  for (LocationCache::iterator it = theCache.begin(); it != theCache.end(); ++it)
+  {
+    if (it->hash == theKey.hash && it->fingerprint == theKey.fingerprint)
+    {
+      theCache.splice(theCache.begin(), theCache, it);
+      return it->locations;
+    }
+  }
+  return std::shared_ptr<Fmi::CoordinateMatrix>();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Cache grid coordinates for an area
+ *
+ * The least recently used coordinates are discarded if the
+ * cache is full.
+ *
+ * \param theCache The cache to insert into
+ * \param theEntry The area and its coordinates
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::InsertLocations(LocationCache &theCache, const AreaLocations &theEntry)
+{
+  theCache.push_front(theEntry);
+  if (theCache.size() > max_cached_areas)
+    theCache.pop_back();
 }
 
 // ----------------------------------------------------------------------
@@ -346,7 +683,12 @@ float LazyQueryData::InterpolatedValue(const NFmiPoint &theLatLonPoint)
 
 NFmiDataMatrix<float> LazyQueryData::Values()
 {
-  return itsInfo->Values();
+  if (itsSliceCacheSize == 0)
+    return itsInfo->Values();
+
+  NFmiDataMatrix<float> values;
+  Values(values);
+  return values;
 }
 // ----------------------------------------------------------------------
 /*!
@@ -356,7 +698,159 @@ NFmiDataMatrix<float> LazyQueryData::Values()
 
 NFmiDataMatrix<float> LazyQueryData::Values(const NFmiMetTime &theTime)
 {
-  return itsInfo->Values(theTime);
+  if (itsSliceCacheSize == 0)
+    return itsInfo->Values(theTime);
+
+  NFmiDataMatrix<float> values;
+  Values(values, theTime);
+  return values;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fetch the current values into the given matrix
+ *
+ * The storage of the matrix is reused if it already has the
+ * correct size, which avoids reallocating the grid for every
+ * parameter and time when the same matrix is filled repeatedly.
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::Values(NFmiDataMatrix<float> &theValues)
+{
+  if (itsSliceCacheSize == 0)
+  {
+    itsInfo->Values(theValues);
+    return;
+  }
+
+  const SliceKey key = CurrentSlice();
+
+  if (const NFmiDataMatrix<float> *slice = FindSlice(key))
+    theValues = *slice;
+  else
+  {
+    NFmiDataMatrix<float> &newslice = NewSlice(key);
+    itsInfo->Values(newslice);
+    theValues = newslice;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fetch the values for the given time into the given matrix
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::Values(NFmiDataMatrix<float> &theValues, const NFmiMetTime &theTime)
+{
+  if (itsSliceCacheSize == 0)
+  {
+    itsInfo->Values(theValues, theTime);
+    return;
+  }
+
+  SliceKey key = CurrentSlice();
+  key.time = ((((theTime.GetYear() * 100LL + theTime.GetMonth()) * 100 + theTime.GetDay()) * 100 +
+               theTime.GetHour()) *
+                  100 +
+              theTime.GetMin());
+  key.interpolated = true;
+
+  if (const NFmiDataMatrix<float> *slice = FindSlice(key))
+    theValues = *slice;
+  else
+  {
+    NFmiDataMatrix<float> &newslice = NewSlice(key);
+    itsInfo->Values(newslice, theTime);
+    theValues = newslice;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum number of cached grids
+ *
+ * \param theSize The number of grids, 0 disables the cache
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::SliceCacheSize(std::size_t theSize)
+{
+  itsSliceCacheSize = theSize;
+  while (itsSlices.size() > itsSliceCacheSize)
+    itsSlices.pop_back();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether two slice keys are equal
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::SliceKey::operator==(const SliceKey &theOther) const
+{
+  return (param == theOther.param && level == theOther.level && time == theOther.time &&
+          interpolated == theOther.interpolated);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the slice key for the current parameter, level and time
+ */
+// ----------------------------------------------------------------------
+
+LazyQueryData::SliceKey LazyQueryData::CurrentSlice() const
+{
+  SliceKey key;
+  key.param = GetParamIdent();
+  key.level = itsInfo->LevelIndex();
+  key.time = itsInfo->TimeIndex();
+  key.interpolated = false;
+  return key;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find a cached slice and mark it most recently used
+ *
+ * \return The cached values, or nullptr if the slice is not cached
+ */
+// ----------------------------------------------------------------------
+
+const NFmiDataMatrix<float> *LazyQueryData::FindSlice(const SliceKey &theKey)
+{
+  for (SliceCache::iterator it = itsSlices.begin(); it != itsSlices.end(); ++it)
+  {
+    if (it->first == theKey)
+    {
+      itsSlices.splice(itsSlices.begin(), itsSlices, it);
+      return &itsSlices.front().second;
+    }
+  }
+  return nullptr;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add a new slice to the cache, evicting the least recently used one
+ *
+ * \return The storage for the values of the new slice
+ */
+// ----------------------------------------------------------------------
+
+NFmiDataMatrix<float> &LazyQueryData::NewSlice(const SliceKey &theKey)
+{
+  if (itsSlices.size() >= itsSliceCacheSize)
+  {
+    // Recycle the storage of the oldest slice
+    itsSlices.splice(itsSlices.begin(), itsSlices, --itsSlices.end());
+    itsSlices.front().first = theKey;
+  }
+  else
+    itsSlices.push_front(std::make_pair(theKey, NFmiDataMatrix<float>()));
+
+  return itsSlices.front().second;
 }
 
 Fmi::CoordinateMatrix LazyQueryData::CoordinateMatrix() const
@@ -0,0 +1,101 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace ParallelTools
+ */
+// ======================================================================
+
+#include "ParallelTools.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ParallelTools
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the given tasks on a pool of threads
+ *
+ * The task is called once for each index 0...theTaskCount-1. The
+ * tasks are handed out to the threads in ascending order, but may
+ * complete in any order. The calling thread participates in the work,
+ * and with a single thread all tasks are run sequentially in order.
+ *
+ * If any task throws, the remaining tasks are skipped and the first
+ * exception is rethrown once all threads have finished. If not all
+ * the threads can be started, the tasks are run by the threads
+ * started so far and the calling thread.
+ *
+ * \param theTaskCount The number of tasks
+ * \param theThreadCount The maximum number of threads to use
+ * \param theTask The task to run for each index
+ */
+// ----------------------------------------------------------------------
+
+void run(std::size_t theTaskCount,
+         unsigned int theThreadCount,
+         const std::function<void(std::size_t)> &theTask)
+{
+  const std::size_t nthreads =
+      std::min<std::size_t>(std::max(theThreadCount, 1U), theTaskCount);
+
+  if (nthreads <= 1)
+  {
+    for (std::size_t i = 0; i < theTaskCount; i++)
+      theTask(i);
+    return;
+  }
+
+  std::atomic<std::size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex errormutex;
+
+  auto worker = [&]()
+  {
+    for (;;)
+    {
+      const std::size_t i = next++;
+      if (i >= theTaskCount || failed)
+        return;
+      try
+      {
+        theTask(i);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(errormutex);
+        if (!failed)
+          error = std::current_exception();
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(nthreads - 1);
+  try
+  {
+    for (std::size_t t = 1; t < nthreads; t++)
+      threads.emplace_back(worker);
+  }
+  catch (const std::exception &)
+  {
+    // For example the process thread limit was reached
+  }
+
+  worker();
+
+  for (auto &thread : threads)
+    thread.join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+}  // namespace ParallelTools
+
+// ======================================================================
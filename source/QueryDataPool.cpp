@@ -0,0 +1,182 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class QueryDataPool
+ */
+// ======================================================================
+
+#include "QueryDataPool.h"
+#include "LazyQueryData.h"
+
+#include <newbase/NFmiFileSystem.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
+
+QueryDataPool::QueryDataPool()
+    : itsData(), itsOrder(), itsBytes(0), itsMaxBytes(0), itsReleases(0)
+{
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test if the pool is empty
+ *
+ * \return True if the pool is empty
+ */
+// ----------------------------------------------------------------------
+
+bool QueryDataPool::empty() const { return itsData.empty(); }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clear the pool
+ *
+ * Querydata still in use elsewhere are kept in the pool.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::clear()
+{
+  storage_type::iterator it = itsData.begin();
+  while (it != itsData.end())
+  {
+    storage_type::iterator entry = it++;
+    if (entry->second.data.use_count() == 1)
+      erase(entry);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of querydata in the pool
+ *
+ * \return The number of querydata
+ */
+// ----------------------------------------------------------------------
+
+QueryDataPool::size_type QueryDataPool::size() const { return itsData.size(); }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove an entry from the pool
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::erase(storage_type::iterator theEntry)
+{
+  itsBytes -= theEntry->second.filesize;
+  itsOrder.erase(theEntry->second.position);
+  itsData.erase(theEntry);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find querydata from the pool
+ *
+ * The querydata is returned only if the file has not changed since
+ * it was read. Outdated querydata is removed from the pool.
+ *
+ * \param theFile The name of the querydata file
+ * \return The querydata, or an empty pointer if not found
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<LazyQueryData> QueryDataPool::find(const string &theFile)
+{
+  storage_type::iterator it = itsData.find(theFile);
+  if (it == itsData.end()) return std::shared_ptr<LazyQueryData>();
+
+  if (it->second.modtime != NFmiFileSystem::FileModificationTime(theFile) ||
+      it->second.filesize != NFmiFileSystem::FileSize(theFile))
+  {
+    erase(it);
+    return std::shared_ptr<LazyQueryData>();
+  }
+
+  // Mark as most recently used
+  itsOrder.splice(itsOrder.begin(), itsOrder, it->second.position);
+
+  return it->second.data;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the memory budget of the pool
+ *
+ * \param theBytes The maximum combined size of the files, 0 for no limit
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::maxBytes(std::size_t theBytes)
+{
+  itsMaxBytes = theBytes;
+  release();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Release least recently used querydata until within budget
+ *
+ * Querydata still in use elsewhere are not released, hence the
+ * pool may remain over the budget.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::release()
+{
+  if (itsMaxBytes == 0)
+    return;
+
+  order_type::iterator it = itsOrder.end();
+  while (itsBytes > itsMaxBytes && it != itsOrder.begin())
+  {
+    --it;
+    storage_type::iterator entry = itsData.find(**it);
+    if (entry->second.data.use_count() > 1)
+      continue;
+
+    ++it;
+    erase(entry);
+    ++itsReleases;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Insert new querydata into the pool
+ *
+ * Throws if the file is already in the pool. Least recently used
+ * querydata are released if the memory budget is exceeded.
+ *
+ * \param theFile The name of the querydata file
+ * \param theData The querydata read from the file
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::insert(const string &theFile, const std::shared_ptr<LazyQueryData> &theData)
+{
+  typedef pair<storage_type::iterator, bool> restype;
+
+  Entry entry;
+  entry.data = theData;
+  entry.modtime = NFmiFileSystem::FileModificationTime(theFile);
+  entry.filesize = NFmiFileSystem::FileSize(theFile);
+
+  restype result = itsData.insert(storage_type::value_type(theFile, entry));
+
+  if (!result.second) throw runtime_error("Querydata '" + theFile + "' was already in the pool!");
+
+  itsOrder.push_front(&result.first->first);
+  result.first->second.position = itsOrder.begin();
+  itsBytes += entry.filesize;
+
+  release();
+}
+
+// ======================================================================